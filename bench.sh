@@ -0,0 +1,121 @@
+#!/usr/bin/env bash
+# End-to-end compile benchmark: builds a large self-contained C file with and
+# without the plugin and fails when the overhead of the instrumented build
+# exceeds a threshold. The default input is the zstd library vendored under
+# bench/zstd, built as one file by bench/zstd.c. Its sources are checked
+# against a pinned hash, so that every run measures the same code; any other
+# file, such as the SQLite amalgamation, can be given instead.
+#
+# Usage: ./bench.sh [source.c]   (default: bench/zstd.c)
+#
+# Environment:
+#   CC, CFLAGS      cross compiler and flags (riscv64-unknown-elf-gcc, -O2)
+#   SIZE            size for the objects of CC (CC with gcc replaced by size)
+#   PLUGIN          the plugin (plugin.so or plugin.dylib)
+#   PLUGIN_ARGS     extra -fplugin-arg-plugin-* options
+#   MAX_TIME_RATIO, MAX_RSS_RATIO, MAX_TEXT_RATIO, MAX_OBJ_RATIO
+#                   instrumented/plain limits (3.0, 2.0, 2.5, 3.0)
+#   MAX_CLONES      limit on the clones made by the plugin (unlimited)
+#   TIME            GNU time (/usr/bin/time)
+set -euo pipefail
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+SRC=${1:-$DIR/bench/zstd.c}
+CC=${CC:-riscv64-unknown-elf-gcc}
+case $CC in
+  *gcc) SIZE=${SIZE:-${CC%gcc}size} ;;
+  *) SIZE=${SIZE:-size} ;;
+esac
+CFLAGS=${CFLAGS:--O2}
+if [ -z "${PLUGIN:-}" ]; then
+  PLUGIN=./plugin.so
+  [ -f "$PLUGIN" ] || PLUGIN=./plugin.dylib
+fi
+PLUGIN_ARGS=${PLUGIN_ARGS:-}
+MAX_TIME_RATIO=${MAX_TIME_RATIO:-3.0}
+MAX_RSS_RATIO=${MAX_RSS_RATIO:-2.0}
+MAX_TEXT_RATIO=${MAX_TEXT_RATIO:-2.5}
+MAX_OBJ_RATIO=${MAX_OBJ_RATIO:-3.0}
+MAX_CLONES=${MAX_CLONES:-}
+TIME=${TIME:-/usr/bin/time}
+
+# The SHA-256 of bench/zstd/SHA256SUMS, which lists those of the sources.
+ZSTD_SHA256=ce27044462729b44eb44f9f2b728bda8e078b9112a4ce1c719212b9e382f1540
+
+if [ ! -f "$SRC" ]; then
+  echo "bench.sh: $SRC not found" >&2
+  exit 2
+fi
+if [ ! -f "$PLUGIN" ]; then
+  echo "bench.sh: $PLUGIN not found; run build.sh first" >&2
+  exit 2
+fi
+if [ ! -x "$TIME" ]; then
+  echo "bench.sh: GNU time not found at $TIME" >&2
+  exit 2
+fi
+if ! command -v "$SIZE" > /dev/null; then
+  echo "bench.sh: $SIZE not found; set SIZE" >&2
+  exit 2
+fi
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+if [ "$SRC" = "$DIR/bench/zstd.c" ] \
+   && { [ "$(sha256sum < "$DIR/bench/zstd/SHA256SUMS" | cut -d' ' -f1)" \
+          != "$ZSTD_SHA256" ] \
+        || ! (cd "$DIR/bench/zstd" && sha256sum -c --quiet SHA256SUMS); }; then
+  echo "bench.sh: the sources under bench/zstd are not the pinned ones;" \
+       "update ZSTD_SHA256 together with the baseline" >&2
+  exit 2
+fi
+
+# compile NAME [FLAGS...]: builds $OUT/NAME.o and records the wall time and
+# the peak RSS of the largest child, i.e. cc1, in $OUT/NAME.time.
+compile() {
+  local name=$1
+  shift
+  "$TIME" -f "%e %M" -o "$OUT/$name.time" \
+    "$CC" $CFLAGS "$@" -c "$SRC" -o "$OUT/$name.o"
+}
+
+compile plain
+compile cfcss -fplugin="$PLUGIN" -fplugin-arg-plugin-stats="$OUT/stats" \
+  $PLUGIN_ARGS
+
+read -r plain_time plain_rss < "$OUT/plain.time"
+read -r cfcss_time cfcss_rss < "$OUT/cfcss.time"
+plain_text=$("$SIZE" "$OUT/plain.o" | awk 'NR == 2 { print $1 }')
+cfcss_text=$("$SIZE" "$OUT/cfcss.o" | awk 'NR == 2 { print $1 }')
+plain_obj=$(wc -c < "$OUT/plain.o")
+cfcss_obj=$(wc -c < "$OUT/cfcss.o")
+clones=$(awk '$1 == "function" { for (i = 3; i < NF; i += 2)
+                                   if ($i == "copies") n += $(i + 1) - 1 }
+              END { print n + 0 }' "$OUT/stats")
+
+status=0
+
+# check LABEL PLAIN CFCSS MAX_RATIO
+check() {
+  local verdict
+  verdict=$(awk -v a="$2" -v b="$3" -v max="$4" 'BEGIN {
+    ratio = a > 0 ? b / a : 1
+    printf "%.3f %s", ratio, (ratio > max ? "FAIL" : "ok") }')
+  printf "%-22s %14s %14s %8s (max %s) %s\n" "$1" "$2" "$3" \
+    "${verdict% *}" "$4" "${verdict#* }"
+  [ "${verdict#* }" = ok ] || status=1
+}
+
+printf "%-22s %14s %14s %8s\n" "" plain cfcss ratio
+check "compile time (s)" "$plain_time" "$cfcss_time" "$MAX_TIME_RATIO"
+check "cc1 peak RSS (KiB)" "$plain_rss" "$cfcss_rss" "$MAX_RSS_RATIO"
+check "text size (bytes)" "$plain_text" "$cfcss_text" "$MAX_TEXT_RATIO"
+check "object size (bytes)" "$plain_obj" "$cfcss_obj" "$MAX_OBJ_RATIO"
+printf "%-22s %14s %14s\n" "clones" 0 "$clones"
+if [ -n "$MAX_CLONES" ] && [ "$clones" -gt "$MAX_CLONES" ]; then
+  echo "clones exceed $MAX_CLONES: FAIL"
+  status=1
+fi
+
+exit $status
@@ -0,0 +1,33 @@
+/* The default input of bench.sh: the zstd 1.5.7 library without its
+   dictionary builder, legacy formats and multithreading, as one translation
+   unit in the way of zstd's own single-file build. The sources under zstd/
+   are unmodified; bench.sh checks them against zstd/SHA256SUMS. */
+#define ZSTD_DISABLE_ASM 1
+#define ZSTD_LEGACY_SUPPORT 0
+#define ZSTD_NO_TRACE 1
+#define DEBUGLEVEL 0
+
+#include "zstd/common/debug.c"
+#include "zstd/common/entropy_common.c"
+#include "zstd/common/error_private.c"
+#include "zstd/common/fse_decompress.c"
+#include "zstd/common/zstd_common.c"
+
+#include "zstd/compress/fse_compress.c"
+#include "zstd/compress/hist.c"
+#include "zstd/compress/huf_compress.c"
+#include "zstd/compress/zstd_compress_literals.c"
+#include "zstd/compress/zstd_compress_sequences.c"
+#include "zstd/compress/zstd_compress_superblock.c"
+#include "zstd/compress/zstd_compress.c"
+#include "zstd/compress/zstd_double_fast.c"
+#include "zstd/compress/zstd_fast.c"
+#include "zstd/compress/zstd_lazy.c"
+#include "zstd/compress/zstd_ldm.c"
+#include "zstd/compress/zstd_opt.c"
+#include "zstd/compress/zstd_preSplit.c"
+
+#include "zstd/decompress/huf_decompress.c"
+#include "zstd/decompress/zstd_ddict.c"
+#include "zstd/decompress/zstd_decompress.c"
+#include "zstd/decompress/zstd_decompress_block.c"
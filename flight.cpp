@@ -0,0 +1,267 @@
+///
+/// Decoder for the flight-recorder mode of the plugin.
+///
+/// In flight-recorder mode (-fplugin-arg-plugin-record=N) every block stores
+/// its 8-bit signature into a per-thread ring instead of being checked, and
+/// the plugin appends every block to a signature map
+/// (-fplugin-arg-plugin-sigmap=FILE). Given the map and a ring dump written by
+/// cfcss_ring_dump() of the runtime, the decoder rebuilds the last blocks
+/// executed before the dump. A signature is shared by many blocks, so each
+/// entry first stands for all of them; the candidates that no edge, call or
+/// return of the map connects to a candidate of the neighbouring entries are
+/// then dropped, forward and backward. Entries left with several candidates
+/// are printed with all of them, and a '|' marks where the history could not
+/// be connected, e.g. after a signal or a callback from a library.
+///
+/// Build: g++ -O2 -o flight flight.cpp
+/// Usage: flight [--last=N] sigmap ring
+///
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// A block of the signature map.
+struct block {
+  std::string function;
+  int index;
+  unsigned sig;
+  std::string location;
+  bool entry = false;
+  bool ret = false;
+  // Calls the decoder cannot follow, such as library calls.
+  bool external = false;
+  std::vector<int> succs;
+  std::vector<std::string> calls;
+};
+
+struct sigmap {
+  std::vector<block> blocks;
+  std::vector<size_t> by_sig[256];
+  std::map<std::string, size_t> entries;
+  // The blocks that may follow a return from a function: the successors of
+  // its callers and the entries of the other functions they call.
+  std::map<std::string, std::set<size_t>> after_return;
+  std::map<std::pair<std::string, int>, size_t> ids;
+};
+
+static bool read_sigmap(const char *path, sigmap &map)
+{
+  std::ifstream file(path);
+  std::string line;
+
+  if (!file)
+    return false;
+  while (std::getline(file, line)) {
+    std::istringstream tokens(line);
+    std::string kind, word;
+    block b;
+    if (!(tokens >> kind >> b.function >> b.index >> b.sig >> b.location)
+        || kind != "block" || b.sig > 255)
+      continue;
+    while (tokens >> word) {
+      if (word == "entry")
+        b.entry = true;
+      else if (word == "ret")
+        b.ret = true;
+      else if (word == "x")
+        b.external = true;
+      else if (word.compare(0, 2, "s:") == 0)
+        b.succs.push_back(atoi(word.c_str() + 2));
+      else if (word.compare(0, 2, "c:") == 0)
+        b.calls.push_back(word.substr(2));
+    }
+    // The same static function may come from several translation units;
+    // the first one wins.
+    auto key = std::make_pair(b.function, b.index);
+    if (map.ids.count(key))
+      continue;
+    map.ids[key] = map.blocks.size();
+    map.by_sig[b.sig].push_back(map.blocks.size());
+    if (b.entry)
+      map.entries[b.function] = map.blocks.size();
+    map.blocks.push_back(b);
+  }
+
+  for (auto &b : map.blocks)
+    for (auto &callee : b.calls) {
+      std::set<size_t> &next = map.after_return[callee];
+      for (int succ : b.succs) {
+        auto it = map.ids.find(std::make_pair(b.function, succ));
+        if (it != map.ids.end())
+          next.insert(it->second);
+      }
+      for (auto &other : b.calls) {
+        auto it = map.entries.find(other);
+        if (it != map.entries.end())
+          next.insert(it->second);
+      }
+    }
+  return true;
+}
+
+/**
+  * @return whether block @param to may be recorded right after block
+  * @param from
+  */
+static bool follows(const sigmap &map, size_t from, size_t to)
+{
+  const block &a = map.blocks[from];
+  const block &b = map.blocks[to];
+
+  if (a.function == b.function
+      && std::find(a.succs.begin(), a.succs.end(), b.index) != a.succs.end())
+    return true;
+  if (b.entry) {
+    if (a.external)
+      return true;
+    if (std::find(a.calls.begin(), a.calls.end(), b.function)
+        != a.calls.end())
+      return true;
+  }
+  if (a.ret) {
+    auto it = map.after_return.find(a.function);
+    if (it != map.after_return.end() && it->second.count(to))
+      return true;
+  }
+  return false;
+}
+
+/**
+  * Reads a ring dump into @param history, oldest entry first. Entries that
+  * were never written are left out; dumps without a count are taken as full.
+  */
+static bool read_ring(const char *path, std::vector<unsigned> &history)
+{
+  std::ifstream file(path);
+  std::string header, magic, kind;
+  std::vector<unsigned> ring;
+  size_t size, pos, count;
+  std::string byte;
+
+  if (!file || !std::getline(file, header))
+    return false;
+  std::istringstream fields(header);
+  if (!(fields >> magic >> kind >> size >> pos) || magic != "cfcss"
+      || kind != "ring" || size == 0)
+    return false;
+  if (!(fields >> count) || count > size)
+    count = size;
+  while (ring.size() < size && file >> byte)
+    ring.push_back(strtoul(byte.c_str(), nullptr, 16) & 0xff);
+  if (ring.size() != size)
+    return false;
+  // Before the ring is full, the oldest entry is the first one.
+  if (count < size)
+    pos = 0;
+  for (size_t i = 0; i < count; ++i)
+    history.push_back(ring[(pos + i) % size]);
+  return true;
+}
+
+static void usage()
+{
+  fprintf(stderr,
+"Usage: flight [options] sigmap ring\n"
+"  --last=N                 decode the last N entries only (all)\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  const char *map_path = nullptr;
+  const char *ring_path = nullptr;
+  size_t last = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--last=", 7) == 0)
+      last = strtoul(argv[i] + 7, nullptr, 0);
+    else if (argv[i][0] == '-' || ring_path)
+      usage();
+    else if (map_path)
+      ring_path = argv[i];
+    else
+      map_path = argv[i];
+  }
+  if (!ring_path)
+    usage();
+
+  sigmap map;
+  std::vector<unsigned> history;
+  if (!read_sigmap(map_path, map)) {
+    fprintf(stderr, "flight: cannot open %s\n", map_path);
+    return 1;
+  }
+  if (!read_ring(ring_path, history)) {
+    fprintf(stderr, "flight: %s is not a ring dump\n", ring_path);
+    return 1;
+  }
+  if (last != 0 && last < history.size())
+    history.erase(history.begin(), history.end() - last);
+
+  size_t n = history.size();
+  std::vector<std::vector<size_t>> cands(n);
+  std::vector<bool> broken(n, false);
+
+  // Forward: keep the candidates some candidate of the previous entry leads
+  // to.
+  for (size_t i = 0; i < n; ++i) {
+    const std::vector<size_t> &all = map.by_sig[history[i]];
+    if (i > 0)
+      for (size_t to : all)
+        for (size_t from : cands[i - 1])
+          if (follows(map, from, to)) {
+            cands[i].push_back(to);
+            break;
+          }
+    if (cands[i].empty()) {
+      cands[i] = all;
+      broken[i] = i > 0;
+    }
+  }
+
+  // Backward: keep the candidates that lead to some candidate of the next
+  // entry.
+  for (size_t i = n - 1; i-- > 0;) {
+    if (broken[i + 1])
+      continue;
+    std::vector<size_t> kept;
+    for (size_t from : cands[i])
+      for (size_t to : cands[i + 1])
+        if (follows(map, from, to)) {
+          kept.push_back(from);
+          break;
+        }
+    if (!kept.empty())
+      cands[i] = kept;
+  }
+
+  size_t resolved = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (broken[i])
+      printf("|\n");
+    printf("%5zd  %02x ", static_cast<ssize_t>(i) - static_cast<ssize_t>(n)
+                          + 1, history[i]);
+    if (cands[i].empty()) {
+      printf(" (unknown signature)\n");
+      continue;
+    }
+    resolved += cands[i].size() == 1;
+    for (size_t j = 0; j < cands[i].size() && j < 3; ++j) {
+      const block &b = map.blocks[cands[i][j]];
+      printf("%s %s bb %d %s", j ? " or" : "", b.function.c_str(), b.index,
+             b.location.c_str());
+    }
+    if (cands[i].size() > 3)
+      printf(" or %zu more", cands[i].size() - 3);
+    printf("\n");
+  }
+  printf("\n%zu of %zu entries resolved to a single block\n", resolved, n);
+  return 0;
+}
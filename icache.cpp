@@ -0,0 +1,393 @@
+///
+/// Static I-cache footprint estimator for the hot paths of an instrumented
+/// build.
+///
+/// The estimator reads the statistics file written by the plugin
+/// (-fplugin-arg-plugin-stats=FILE) and, optionally, a profile, picks the
+/// functions that make up the hot part of the profile and compares their
+/// instruction working set before and after instrumentation with the I-cache.
+/// The growth counts the ctrlsig instructions, the pushsig/popsig pairs, the
+/// blocks created by split_edge, the adds and checks of path IDs, the copies
+/// made for call sites and the stubs that replace copies, so that cloning
+/// that pushes a hot loop out of the cache is caught at build time.
+///
+/// Each profile line holds a weight, such as a sample count or a percentage,
+/// as its first number and the symbol as its last word, which covers
+/// `perf report --stdio` and `sort | uniq -c` over symbolized samples. Copies
+/// appear as NAME.cfcss.N; when the profile names a function only by its
+/// original name, every copy of it counts as hot.
+///
+/// Build: g++ -O2 -o icache icache.cpp
+/// Usage: icache [options] stats [profile]
+///
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct icache_config {
+  // I-cache geometry, as in sim.
+  unsigned icache_size = 16384;
+  unsigned icache_line = 32;
+  unsigned icache_assoc = 2;
+
+  // Size of a ctrlsig, 2 if it is compressed.
+  unsigned ctrlsig_bytes = 4;
+
+  // Share of the profile weight that is hot.
+  double hot = 0.9;
+
+  // Fail when the hot set fills more than this share of the cache.
+  double max_fill = 1.0;
+
+  // Functions listed by growth.
+  unsigned top = 10;
+};
+
+// A function and all its copies, as the plugin reports them.
+struct function_info {
+  double copies = 0;
+  double stubs = 0;
+  double size = 0;
+  double ctrlsig = 0;
+  double pushsig = 0;
+  double split_edges = 0;
+  double path_adds = 0;
+  double path_checks = 0;
+  double hash_updates = 0;
+  double hash_checks = 0;
+  // Profile weight of the function as a whole and of the copies named in
+  // the profile.
+  double weight = 0;
+  std::map<unsigned, double> copy_weight;
+};
+
+// A function of the hot set with its footprint.
+struct hot_function {
+  std::string name;
+  unsigned hot_copies;
+  unsigned copies;
+  double before;
+  double after;
+};
+
+/**
+  * Reads the statistics file at @param path into @param functions. The same
+  * function may appear once per translation unit; the lines are added up.
+  */
+static bool read_stats(const char *path,
+                       std::map<std::string, function_info> &functions)
+{
+  std::ifstream file(path);
+  std::string line;
+
+  if (!file)
+    return false;
+  while (std::getline(file, line)) {
+    std::istringstream tokens(line);
+    std::string kind, name, key;
+    double val;
+    if (!(tokens >> kind >> name) || kind != "function")
+      continue;
+    function_info &fn = functions[name];
+    while (tokens >> key >> val) {
+      if (key == "copies")
+        fn.copies += val;
+      else if (key == "stubs")
+        fn.stubs += val;
+      else if (key == "size")
+        fn.size += val;
+      else if (key == "ctrlsig_s" || key == "ctrlsig_m")
+        fn.ctrlsig += val;
+      else if (key == "pushsig")
+        fn.pushsig += val;
+      else if (key == "split_edges")
+        fn.split_edges += val;
+      else if (key == "path_adds")
+        fn.path_adds += val;
+      else if (key == "path_checks")
+        fn.path_checks += val;
+      else if (key == "hash_updates")
+        fn.hash_updates += val;
+      else if (key == "hash_checks")
+        fn.hash_checks += val;
+    }
+  }
+  return true;
+}
+
+/**
+  * Splits a symbol of a copy, NAME.cfcss.N, into @param name and
+  * @param copy. Other symbols are copy 0 of themselves.
+  */
+static void split_copy(const std::string &symbol, std::string &name,
+                       unsigned &copy)
+{
+  size_t pos = symbol.rfind(".cfcss.");
+  char *end;
+
+  name = symbol;
+  copy = 0;
+  if (pos == std::string::npos)
+    return;
+  unsigned long num = strtoul(symbol.c_str() + pos + 7, &end, 10);
+  if (end == symbol.c_str() + pos + 7 || *end != '\0')
+    return;
+  name = symbol.substr(0, pos);
+  copy = num;
+}
+
+/**
+  * Adds the weights of the profile at @param path to @param functions.
+  * Symbols that the statistics do not know are ignored.
+  */
+static bool read_profile(const char *path,
+                         std::map<std::string, function_info> &functions)
+{
+  std::ifstream file(path);
+  std::string line;
+
+  if (!file)
+    return false;
+  while (std::getline(file, line)) {
+    std::istringstream tokens(line);
+    std::string first, word, symbol, name;
+    unsigned copy;
+    char *end;
+
+    if (!(tokens >> first) || first[0] == '#')
+      continue;
+    double weight = strtod(first.c_str(), &end);
+    if (end == first.c_str() || (*end != '\0' && strcmp(end, "%") != 0))
+      continue;
+    while (tokens >> word)
+      symbol = word;
+    if (symbol.empty())
+      continue;
+
+    split_copy(symbol, name, copy);
+    auto it = functions.find(name);
+    if (it == functions.end())
+      continue;
+    it->second.weight += weight;
+    it->second.copy_weight[copy] += weight;
+  }
+  return true;
+}
+
+/**
+  * @return the expected number of lines that do not fit in their set when
+  * @param lines lines fall into @param sets sets of @param assoc ways at
+  * random, i.e. when the hot code is scattered among cold code
+  */
+static double expected_overflow(double lines, unsigned sets, unsigned assoc)
+{
+  double p = 1.0 / sets;
+  long n = std::lround(lines);
+  double sum = n * p - assoc;
+
+  if (n == 0)
+    return 0;
+  // E[max(0, X - A)] = E[X] - A + sum over k < A of (A - k) P(X = k).
+  for (long k = 0; k < assoc && k <= n; ++k) {
+    double log_pmf = std::lgamma(n + 1.0) - std::lgamma(k + 1.0)
+                     - std::lgamma(n - k + 1.0) + k * std::log(p)
+                     + (n - k) * std::log1p(-p);
+    sum += (assoc - k) * std::exp(log_pmf);
+  }
+  return sets * std::max(0.0, sum);
+}
+
+static unsigned num_lines(double bytes, unsigned line)
+{
+  return static_cast<unsigned>(std::ceil(bytes / line));
+}
+
+static void usage()
+{
+  fprintf(stderr,
+"Usage: icache [options] stats [profile]\n"
+"  --icache-size=N          I-cache size in bytes (16384)\n"
+"  --icache-line=N          line size in bytes (32)\n"
+"  --icache-assoc=N         associativity (2)\n"
+"  --ctrlsig-bytes=N        size of a ctrlsig (4)\n"
+"  --hot=F                  share of the profile weight that is hot (0.9)\n"
+"  --max-fill=F             fail above this share of the cache (1.0)\n"
+"  --top=N                  functions listed by growth (10)\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  icache_config cfg;
+  const char *stats_path = nullptr;
+  const char *profile_path = nullptr;
+  struct {
+    const char *name;
+    unsigned *val;
+  } uint_opts[] = {
+    { "--icache-size=", &cfg.icache_size },
+    { "--icache-line=", &cfg.icache_line },
+    { "--icache-assoc=", &cfg.icache_assoc },
+    { "--ctrlsig-bytes=", &cfg.ctrlsig_bytes },
+    { "--top=", &cfg.top },
+  };
+  struct {
+    const char *name;
+    double *val;
+  } double_opts[] = {
+    { "--hot=", &cfg.hot },
+    { "--max-fill=", &cfg.max_fill },
+  };
+
+  for (int i = 1; i < argc; ++i) {
+    bool matched = false;
+    for (auto &opt : uint_opts) {
+      size_t len = strlen(opt.name);
+      if (strncmp(argv[i], opt.name, len) == 0) {
+        *opt.val = strtoul(argv[i] + len, nullptr, 0);
+        matched = true;
+      }
+    }
+    for (auto &opt : double_opts) {
+      size_t len = strlen(opt.name);
+      if (strncmp(argv[i], opt.name, len) == 0) {
+        *opt.val = strtod(argv[i] + len, nullptr);
+        matched = true;
+      }
+    }
+    if (matched)
+      continue;
+    if (argv[i][0] == '-' || profile_path)
+      usage();
+    else if (stats_path)
+      profile_path = argv[i];
+    else
+      stats_path = argv[i];
+  }
+  if (!stats_path || cfg.icache_line == 0 || cfg.icache_assoc == 0
+      || cfg.icache_size < cfg.icache_line * cfg.icache_assoc)
+    usage();
+
+  std::map<std::string, function_info> functions;
+  if (!read_stats(stats_path, functions)) {
+    fprintf(stderr, "icache: cannot open %s\n", stats_path);
+    return 1;
+  }
+  if (profile_path && !read_profile(profile_path, functions)) {
+    fprintf(stderr, "icache: cannot open %s\n", profile_path);
+    return 1;
+  }
+
+  // Without a profile, all the code is hot.
+  double total_weight = 0;
+  for (auto &pair : functions) {
+    if (!profile_path)
+      pair.second.weight = 1;
+    total_weight += pair.second.weight;
+  }
+
+  std::vector<std::pair<double, std::string>> by_weight;
+  for (auto &pair : functions)
+    if (pair.second.weight > 0)
+      by_weight.push_back(std::make_pair(pair.second.weight, pair.first));
+  std::sort(by_weight.rbegin(), by_weight.rend());
+
+  std::vector<hot_function> hot;
+  double weight = 0;
+  for (auto &entry : by_weight) {
+    if (weight >= cfg.hot * total_weight)
+      break;
+    weight += entry.first;
+
+    const function_info &fn = functions[entry.second];
+    unsigned copies = std::max(1.0, fn.copies);
+    // The instrumentation of a copy, on average.
+    double per_copy = fn.size
+                      + (cfg.ctrlsig_bytes * fn.ctrlsig + 8 * fn.pushsig
+                         + (cfg.ctrlsig_bytes + 4) * fn.split_edges
+                         // An add, and a compare, a branch and a call.
+                         + 4 * fn.path_adds + 16 * fn.path_checks
+                         // A CRC step, and a lookup, a compare, a branch
+                         // and a call.
+                         + 20 * fn.hash_updates + 24 * fn.hash_checks)
+                         / copies;
+    // A profile that names copies tells which of them are hot.
+    bool named = false;
+    for (auto &copy : fn.copy_weight)
+      named = named || copy.first != 0;
+    unsigned hot_copies = named ? fn.copy_weight.size() : copies;
+
+    hot.push_back({ entry.second, std::min(hot_copies, copies), copies,
+                    fn.size, std::min(hot_copies, copies) * per_copy
+                              + 8 * fn.stubs });
+  }
+
+  double before = 0, after = 0;
+  unsigned before_lines = 0, after_lines = 0;
+  for (auto &fn : hot) {
+    before += fn.before;
+    after += fn.after;
+    before_lines += num_lines(fn.before, cfg.icache_line);
+    after_lines += num_lines(fn.after, cfg.icache_line);
+  }
+
+  unsigned capacity = cfg.icache_size / cfg.icache_line;
+  unsigned sets = capacity / cfg.icache_assoc;
+  double before_conflicts =
+    expected_overflow(before_lines, sets, cfg.icache_assoc);
+  double after_conflicts =
+    expected_overflow(after_lines, sets, cfg.icache_assoc);
+  auto pct = [](double part, double whole) {
+    return whole > 0 ? 100.0 * part / whole : 0.0;
+  };
+
+  printf("I-cache             %u bytes, %u-byte lines, %u-way, %u sets\n",
+         cfg.icache_size, cfg.icache_line, cfg.icache_assoc, sets);
+  printf("hot functions       %zu of %zu (%.1f%% of the weight)\n",
+         hot.size(), functions.size(), pct(weight, total_weight));
+  printf("%-20s%14s%14s%10s\n", "", "plain", "cfcss", "growth");
+  printf("%-20s%14.0f%14.0f%9.1f%%\n", "hot bytes", before, after,
+         pct(after - before, before));
+  printf("%-20s%14u%14u%9.1f%%\n", "hot lines", before_lines, after_lines,
+         pct(after_lines - (double) before_lines, before_lines));
+  printf("%-20s%13.1f%%%13.1f%%\n", "cache fill",
+         pct(before_lines, capacity), pct(after_lines, capacity));
+  printf("%-20s%14.1f%14.1f\n", "conflict lines", before_conflicts,
+         after_conflicts);
+
+  std::vector<hot_function> by_growth(hot);
+  std::sort(by_growth.begin(), by_growth.end(),
+            [](const hot_function &a, const hot_function &b) {
+              return a.after - a.before > b.after - b.before;
+            });
+  if (by_growth.size() > cfg.top)
+    by_growth.resize(cfg.top);
+  if (!by_growth.empty())
+    printf("\n%-32s%8s%10s%10s%10s%8s\n", "largest growth", "copies",
+           "plain", "cfcss", "growth", "clones");
+  for (auto &fn : by_growth) {
+    double growth = fn.after - fn.before;
+    // What the hot copies beyond the first add.
+    double cloned = fn.after * (fn.hot_copies - 1) / fn.hot_copies;
+    printf("%-32s%4u/%-3u%10.0f%10.0f%10.0f%7.0f%%\n", fn.name.c_str(),
+           fn.hot_copies, fn.copies, fn.before, fn.after, growth,
+           pct(cloned, growth));
+  }
+
+  int status = 0;
+  if (after_lines > cfg.max_fill * capacity) {
+    printf("\nhot set exceeds %.0f%% of the I-cache: FAIL\n",
+           100 * cfg.max_fill);
+    status = 1;
+  }
+  if (before_lines <= capacity && after_lines > capacity)
+    printf("instrumentation pushes the hot set out of the I-cache\n");
+  return status;
+}
@@ -10,16 +10,192 @@
 #include "tree.h"
 #include "gimple.h"
 #include "gimple-iterator.h"
+#include "dominance.h"
+#include "predict.h"
+#include "tree-cfg.h"
 #include "cgraph.h"
 #include "plugin-version.h"
 #include "tree-pass.h"
+#include "tree-inline.h"
+#include "dumpfile.h"
+#include "stringpool.h"
+#include "varasm.h"
+#include "ssa.h"
+#include "tree-into-ssa.h"
 #include "util.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <set>
+#include <sstream>
+#include <string>
 #include <vector>
 
 typedef uint8_t cfcss_sig_t;
 
+// Instrumentation options. They are set for the whole module with
+// -fplugin-arg-<name>-<key>=<value> and may be overridden per function in the
+// options file.
+struct cfcss_options {
+  // The maximum number of copies of a function, the original included, its
+  // call sites are spread over. 0 means one copy per call site.
+  size_t clone_budget = 0;
+
+  // Move the check of a loop header into the alignment padding in front of
+  // it.
+  bool align_padding = false;
+
+  // Derive the signatures of a function from its own name instead of its
+  // position in the module, so that they do not change with the rest of the
+  // LTO partition.
+  bool stable_signatures = false;
+
+  // The function is a signal handler even though it is not installed in a
+  // way the pass recognizes.
+  bool signal_handler = false;
+
+  // Verify the returns in the function itself and leave the continuations
+  // of its call sites unchecked.
+  bool return_check = false;
+
+  // Functions of at least this many bytes get a stub per call site class
+  // instead of a copy; 0 means never.
+  size_t stub_size = 0;
+
+  // Check only the blocks off a maximum-weight spanning forest of the CFG,
+  // with at most tree_max_stmts statements per tree (0: no limit).
+  bool spanning_tree = false;
+  size_t tree_max_stmts = 0;
+
+  // Check the function by Ball-Larus path IDs at back edges and returns
+  // instead of by signatures in every block.
+  bool path_check = false;
+
+  // Also hash the blocks the path takes, and check the hash against the
+  // one the path ID calls for. Implies path_check.
+  bool hash_check = false;
+
+  // Give the blocks cross-jumping could fold into one the same check, so
+  // that the merge still happens. Tail merging in GIMPLE never merges blocks
+  // with asm statements, so only the RTL pass can.
+  bool unify_tails = false;
+
+  // Hand G over to and from the function at published signatures that only
+  // depend on its name, so that it can be patched without its callers and
+  // callees. The function is not copied for its call sites. The functions it
+  // calls get boundary signatures too, as their checks would otherwise
+  // depend on its own.
+  bool boundary_signatures = false;
+
+  // How to instrument the function if it only runs before main(), i.e. it is
+  // a static constructor or only reached from them: 0 like any other, 1 by
+  // its entry and the returns of its calls only, 2 not at all as long as it
+  // only calls such functions itself.
+  size_t startup_level = 0;
+};
+
+// Statistics of a function and all its copies.
+struct cfcss_stats {
+  size_t copies = 1;
+  // Stubs that call the shared body in place of copies.
+  size_t stubs = 0;
+  // Estimated size in bytes of the function before instrumentation.
+  size_t size = 0;
+  size_t blocks = 0;
+  size_t ctrlsig_s = 0;
+  size_t ctrlsig_m = 0;
+  size_t split_edges = 0;
+  size_t pushsig = 0;
+  // Edges that add to the path ID, and checks of the path ID.
+  size_t path_adds = 0;
+  size_t path_checks = 0;
+  // Blocks that update the path hash, and checks of the path hash.
+  size_t hash_updates = 0;
+  size_t hash_checks = 0;
+  // Blocks that took the signature of an identical block.
+  size_t unified_blocks = 0;
+  // Call sites of the function defined in this module.
+  size_t call_sites = 0;
+  // Call sites that do not share their copy with any other call site.
+  size_t private_call_sites = 0;
+  // CFG edges, and those whose source cannot jump to any other block of the
+  // function undetected.
+  size_t edges = 0;
+  size_t protected_edges = 0;
+  // Jumps from a checked block to a block of the same function that is not
+  // its successor, and those the check of the target detects.
+  size_t illegal_jumps = 0;
+  size_t detected_jumps = 0;
+  // Returns from a copy of the function to the continuation of one of its
+  // call sites, and those that cannot end up at any other continuation
+  // undetected.
+  size_t return_edges = 0;
+  size_t protected_return_edges = 0;
+  // Blocks whose signature is also the signature of another block.
+  size_t aliased_blocks = 0;
+  // The most statements executed between two checks, -1 if unbounded.
+  long max_unchecked = 0;
+};
+
+// The check inserted at the start of a block: G = G ^ d (^ D for
+// ctrlsig_m), then G must equal S, and D is set. A block may end with
+// another check, so G_out and D_out are the values the block leaves.
+struct cfcss_check {
+  bool multi;
+  cfcss_sig_t d;
+  cfcss_sig_t S;
+  cfcss_sig_t D;
+  cfcss_sig_t G_out;
+  cfcss_sig_t D_out;
+};
+
+// A loop header whose check is moved to the end of the only block entering
+// the loop.
+struct padded_header {
+  basic_block preheader;
+  std::vector<basic_block> latches;
+};
+
+// The values the path ID may hold in a block: any value from lo to hi or,
+// if the range is narrow enough for mask to be set, only the values lo + i
+// for which bit i of mask is set.
+struct path_range {
+  uint64_t lo;
+  uint64_t hi;
+  uint64_t mask;
+};
+
+// The most acyclic paths a function checked by path ID may have, so that the
+// IDs fit in 32 bits.
+static const uint64_t max_paths = (uint64_t) 1 << 31;
+
+// The most acyclic paths a function checked by path hash may have, so that
+// the tables of the expected hashes stay small.
+static const uint64_t max_hashed_paths = 4096;
+
+// The path hash is a bit-forward CRC-32C of the blocks taken, started at
+// crc_init at the entry and again after each back edge.
+static const uint32_t crc_poly = 0x1edc6f41;
+static const uint32_t crc_init = 0xffffffff;
+
+static cfcss_options global_opts;
+
+// Options of individual functions, keyed by name.
+static std::map<std::string, cfcss_options> function_opts;
+
+// Where to append the statistics, if anywhere.
+static std::string stats_path;
+
+// Entries of the flight-recorder ring, 0 if the blocks are checked instead,
+// and the file the signature map is appended to.
+static size_t record_size = 0;
+static std::string sigmap_path;
+
+// Whether to print a summary of the protection metrics.
+static bool report = false;
+
 // This plugin is licensed under GPL.
 #ifdef _WIN32
 __declspec(dllexport)
@@ -31,7 +207,7 @@ public:
   pass_cfcss() : simple_ipa_opt_pass({
     SIMPLE_IPA_PASS,
     "cfcss",
-    OPTGROUP_NONE,
+    OPTGROUP_OTHER,
     TV_INTEGRATION,
     0,
     0,
@@ -51,6 +227,1531 @@ public:
   unsigned int execute(function *fun) override;
 };
 
+/**
+  * @return the options that apply to @param node
+  */
+static const cfcss_options &options_for(cgraph_node *node) {
+  auto it = function_opts.find(node->asm_name());
+  if (it == function_opts.end())
+    it = function_opts.find(node->name());
+  return it == function_opts.end() ? global_opts : it->second;
+}
+
+/**
+  * Sets option @param key of @param opts to @param value.
+  * @return false if there is no such option or the value is invalid
+  */
+static bool set_option(cfcss_options &opts, const char *key,
+                       const char *value) {
+  char *end;
+
+  if (!value || !*value)
+    return false;
+  if (strcmp(key, "clone-budget") == 0) {
+    opts.clone_budget = strtoul(value, &end, 10);
+    return *end == '\0';
+  }
+  if (strcmp(key, "align-padding") == 0) {
+    opts.align_padding = strtoul(value, &end, 10) != 0;
+    return *end == '\0';
+  }
+  if (strcmp(key, "stable-signatures") == 0) {
+    opts.stable_signatures = strtoul(value, &end, 10) != 0;
+    return *end == '\0';
+  }
+  if (strcmp(key, "signal-handler") == 0) {
+    opts.signal_handler = strtoul(value, &end, 10) != 0;
+    return *end == '\0';
+  }
+  if (strcmp(key, "spanning-tree") == 0) {
+    opts.spanning_tree = strtoul(value, &end, 10) != 0;
+    return *end == '\0';
+  }
+  if (strcmp(key, "tree-max-stmts") == 0) {
+    opts.tree_max_stmts = strtoul(value, &end, 10);
+    return *end == '\0';
+  }
+  if (strcmp(key, "path-check") == 0) {
+    opts.path_check = strtoul(value, &end, 10) != 0;
+    return *end == '\0';
+  }
+  if (strcmp(key, "hash-check") == 0) {
+    opts.hash_check = strtoul(value, &end, 10) != 0;
+    return *end == '\0';
+  }
+  if (strcmp(key, "boundary-signatures") == 0) {
+    opts.boundary_signatures = strtoul(value, &end, 10) != 0;
+    return *end == '\0';
+  }
+  if (strcmp(key, "startup-level") == 0) {
+    opts.startup_level = strtoul(value, &end, 10);
+    return *end == '\0' && opts.startup_level <= 2;
+  }
+  if (strcmp(key, "unify-tails") == 0) {
+    opts.unify_tails = strtoul(value, &end, 10) != 0;
+    return *end == '\0';
+  }
+  if (strcmp(key, "stub-size") == 0) {
+    opts.stub_size = strtoul(value, &end, 10);
+    return *end == '\0';
+  }
+  if (strcmp(key, "return-check") == 0) {
+    opts.return_check = strtoul(value, &end, 10) != 0;
+    return *end == '\0';
+  }
+  return false;
+}
+
+/**
+  * @return an FNV-1a hash of @param str folded into a signature
+  */
+static cfcss_sig_t hash_signature(const std::string &str) {
+  uint32_t hash = 2166136261u;
+
+  for (char c : str)
+    hash = (hash ^ (unsigned char) c) * 16777619u;
+  return (hash ^ hash >> 8 ^ hash >> 16 ^ hash >> 24) & 0xff;
+}
+
+/**
+  * @return the first signature of @param node when signatures are stable: a
+  * hash of its assembler name, which the copies get from their origin and
+  * copy number
+  */
+static cfcss_sig_t signature_seed(cgraph_node *node) {
+  return hash_signature(node->asm_name());
+}
+
+/**
+  * @return the published entry signature of @param node, or its return
+  * signature if not @param entry. Callers set G to the former before the
+  * call and expect the latter after it.
+  */
+static cfcss_sig_t boundary_signature(cgraph_node *node, bool entry) {
+  return hash_signature(std::string(node->asm_name())
+                        + (entry ? "@entry" : "@return"));
+}
+
+/**
+  * Orders functions by assembler name, which unlike the symbol table order
+  * does not depend on the other functions of the LTO partition.
+  */
+static bool asm_name_less(cgraph_node *a, cgraph_node *b) {
+  return strcmp(a->asm_name(), b->asm_name()) < 0;
+}
+
+/**
+  * Reads per-function options. Each line holds a function name followed by
+  * key=value pairs; everything after a '#' is a comment.
+  */
+static bool read_options_file(const char *path) {
+  std::ifstream file(path);
+  std::string line;
+  size_t line_num = 0;
+
+  if (!file) {
+    std::cerr << "Control flow checking error: cannot open " << path
+              << std::endl;
+    return false;
+  }
+  while (std::getline(file, line)) {
+    ++line_num;
+    std::istringstream tokens(line.substr(0, line.find('#')));
+    std::string fun_name, opt;
+    if (!(tokens >> fun_name))
+      continue;
+    cfcss_options &opts = function_opts[fun_name] = global_opts;
+    while (tokens >> opt) {
+      size_t eq = opt.find('=');
+      if (eq == std::string::npos
+          || !set_option(opts, opt.substr(0, eq).c_str(),
+                         opt.c_str() + eq + 1)) {
+        std::cerr << "Control flow checking error: " << path << ":"
+                  << line_num << ": invalid option " << opt << std::endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+  * @return whether @param stmt is an instruction inserted by this pass
+  */
+static bool is_cfcss_asm(gimple *stmt) {
+  return gimple_code(stmt) == GIMPLE_ASM
+         && strncmp(gimple_asm_string(as_a<gasm *>(stmt)),
+                    ".insn r CUSTOM_", 15) == 0;
+}
+
+/**
+  * @return whether the check of @param dst accepts the state left by the
+  * check of @param src, i.e. a jump from src to dst goes undetected
+  */
+static bool check_accepts(const cfcss_check &src, const cfcss_check &dst) {
+  return (src.G_out ^ dst.d ^ (dst.multi ? src.D_out : 0)) == dst.S;
+}
+
+/**
+  * @return the location remarks about @param bb are reported at
+  */
+static dump_user_location_t block_location(basic_block bb, function *fun) {
+  for (auto gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi))
+    if (gimple_has_location(gsi_stmt(gsi)))
+      return dump_user_location_t(gsi_stmt(gsi));
+  return dump_user_location_t::from_function_decl(fun->decl);
+}
+
+/**
+  * @return a rough estimate of the code size of @param node in bytes, with a
+  * ctrlsig per block if @param checks
+  */
+static int estimate_size(cgraph_node *node, bool checks = true) {
+  int num_insns = 0;
+  basic_block bb;
+
+  push_cfun(node->get_fun());
+  FOR_EACH_BB_FN (bb, cfun) {
+    // Every block gets a ctrlsig.
+    if (checks)
+      ++num_insns;
+    for (auto gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi))
+      num_insns += estimate_num_insns(gsi_stmt(gsi), &eni_size_weights);
+  }
+  pop_cfun();
+  return num_insns * 4;
+}
+
+/**
+  * Finds the loop headers of @param node the compiler aligns and whose check
+  * can move to the end of the only block entering the loop, i.e. into the
+  * padding in front of the header when that block falls through. The
+  * latches will take the signature of the header, so the back edges need no
+  * check either. Blocks in @param fixed are left alone, as their signatures
+  * are bound to calls, and G does not hold the signature of a call block
+  * once the call returns.
+  */
+static void find_padded_headers(cgraph_node *node,
+                                const std::set<basic_block> &fixed,
+                                std::map<basic_block, padded_header> &headers) {
+  function *fun = node->get_fun();
+  std::map<basic_block, padded_header> found;
+  basic_block bb;
+
+  if (!opt_for_fn(node->decl, flag_align_loops))
+    return;
+
+  push_cfun(fun);
+  calculate_dominance_info(CDI_DOMINATORS);
+  FOR_EACH_BB_FN (bb, fun) {
+    padded_header hdr = { nullptr, {} };
+    bool ok = fixed.count(bb) == 0 && optimize_bb_for_speed_p(bb);
+
+    for (edge pred : *bb->preds) {
+      if (!ok)
+        break;
+      ok = single_succ_p(pred->src) && pred->src != bb
+           && pred->src != ENTRY_BLOCK_PTR_FOR_FN(fun)
+           && fixed.count(pred->src) == 0
+           && !(pred->flags & EDGE_ABNORMAL);
+      if (dominated_by_p(CDI_DOMINATORS, pred->src, bb))
+        hdr.latches.push_back(pred->src);
+      else if (hdr.preheader)
+        ok = false;
+      else
+        hdr.preheader = pred->src;
+    }
+    if (!ok || !hdr.preheader || hdr.latches.empty())
+      continue;
+
+    auto gsi = gsi_last_bb(hdr.preheader);
+    if (gsi_end_p(gsi) || !stmt_ends_bb_p(gsi_stmt(gsi)))
+      found[bb] = hdr;
+  }
+  free_dominance_info(CDI_DOMINATORS);
+  pop_cfun();
+
+  // Nested headers would have to hand the moved checks on; keep it simple
+  // and leave the outer one alone.
+  for (auto &pair : found) {
+    bool conflict = found.count(pair.second.preheader);
+    for (basic_block latch : pair.second.latches)
+      conflict = conflict || found.count(latch);
+    if (!conflict)
+      headers.insert(pair);
+  }
+}
+
+/**
+  * Creates stub @param num of @param body: a local function with the same
+  * signature that only calls @param body. Call sites redirected to the stub
+  * get entry and return checks of their own while the body is shared.
+  */
+static cgraph_node *create_stub(cgraph_node *body, size_t num) {
+  tree decl = copy_node(body->decl);
+  tree *parm = &DECL_ARGUMENTS(decl);
+
+  DECL_NAME(decl) = clone_function_name(body->decl, "cfcss_stub", num);
+  SET_DECL_ASSEMBLER_NAME(decl, DECL_NAME(decl));
+  SET_DECL_RTL(decl, NULL);
+  DECL_STRUCT_FUNCTION(decl) = nullptr;
+  TREE_PUBLIC(decl) = 0;
+  DECL_EXTERNAL(decl) = 0;
+  DECL_COMDAT(decl) = 0;
+  DECL_WEAK(decl) = 0;
+  DECL_VIRTUAL_P(decl) = 0;
+  DECL_STATIC_CONSTRUCTOR(decl) = 0;
+  DECL_STATIC_DESTRUCTOR(decl) = 0;
+  DECL_RESULT(decl) = copy_node(DECL_RESULT(body->decl));
+  DECL_CONTEXT(DECL_RESULT(decl)) = decl;
+  for (tree arg = DECL_ARGUMENTS(body->decl); arg; arg = DECL_CHAIN(arg)) {
+    *parm = copy_node(arg);
+    DECL_CONTEXT(*parm) = decl;
+    parm = &DECL_CHAIN(*parm);
+  }
+
+  // Nothing to debug in a stub; the backtrace goes on in the body.
+  DECL_ARTIFICIAL(decl) = 1;
+  DECL_IGNORED_P(decl) = 1;
+
+  cgraph_node *stub = cgraph_node::create(decl);
+  stub->create_wrapper(body);
+  stub->lowered = true;
+  // A tail call would return past the check of the stub.
+  gimple_call_set_tail(stub->callees->call_stmt, false);
+  symtab->call_cgraph_insertion_hooks(stub);
+  return stub;
+}
+
+/**
+  * @return the return statement @param bb ends with, if any
+  */
+static gimple *return_stmt(basic_block bb) {
+  auto gsi = gsi_last_bb(bb);
+  if (gsi_end_p(gsi) || gimple_code(gsi_stmt(gsi)) != GIMPLE_RETURN)
+    return nullptr;
+  return gsi_stmt(gsi);
+}
+
+/**
+  * @return a reference to the external variable @param name of type
+  * @param type, which the runtime defines
+  */
+static tree runtime_var(const char *name, tree type) {
+  tree decl = build_decl(UNKNOWN_LOCATION, VAR_DECL, get_identifier(name),
+                         type);
+  TREE_PUBLIC(decl) = 1;
+  DECL_EXTERNAL(decl) = 1;
+  varpool_node::get_create(decl);
+  return decl;
+}
+
+/**
+  * @return a reference to the external, initial-exec TLS variable
+  * @param name of type @param type, which the runtime defines
+  */
+static tree tls_var(const char *name, tree type) {
+  tree decl = runtime_var(name, type);
+  set_decl_tls_model(decl, TLS_MODEL_INITIAL_EXEC);
+  return decl;
+}
+
+/**
+  * Appends block @param bb of @param node with signature @param bb_sig to
+  * the signature map @param file: its successors, the functions it calls
+  * ("x" for calls the decoder cannot follow) and whether it is the entry or
+  * a return block.
+  */
+static void write_sigmap_block(FILE *file, cgraph_node *node, basic_block bb,
+                               cfcss_sig_t bb_sig) {
+  function *fun = node->get_fun();
+  const char *src_file = "?";
+  int line = 0;
+
+  for (auto gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi))
+    if (gimple_has_location(gsi_stmt(gsi))) {
+      expanded_location loc = expand_location(gimple_location(gsi_stmt(gsi)));
+      src_file = loc.file ? loc.file : "?";
+      line = loc.line;
+      break;
+    }
+  fprintf(file, "block %s %d %u %s:%d", node->asm_name(), bb->index,
+          (unsigned) bb_sig, src_file, line);
+  if (bb == ENTRY_BLOCK_PTR_FOR_FN(fun)->next_bb)
+    fprintf(file, " entry");
+  for (edge succ : *bb->succs)
+    if (succ->dest != EXIT_BLOCK_PTR_FOR_FN(fun))
+      fprintf(file, " s:%d", succ->dest->index);
+  for (auto gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi)) {
+    gimple *stmt = gsi_stmt(gsi);
+    if (!is_gimple_call(stmt))
+      continue;
+    tree fndecl = gimple_call_fndecl(stmt);
+    cgraph_node *callee = fndecl ? cgraph_node::get(fndecl) : nullptr;
+    if (callee && callee->has_gimple_body_p())
+      fprintf(file, " c:%s", callee->asm_name());
+    else
+      fprintf(file, " x");
+  }
+  if (return_stmt(bb))
+    fprintf(file, " ret");
+  fprintf(file, "\n");
+}
+
+/**
+  * Flight-recorder mode: every block of @param functions stores its
+  * signature into the per-thread ring cfcss_ring of record_size entries, at
+  * the index cfcss_ring_count selects, and counts it there. Nothing is
+  * compared, so there is no check and no branch. The signature map lets the
+  * decoder turn the ring back into blocks, and the count tells it which
+  * entries were never written.
+  */
+static void record_blocks(const std::vector<cgraph_node *> &functions) {
+  tree ring = tls_var("cfcss_ring",
+                      build_array_type_nelts(unsigned_char_type_node,
+                                             record_size));
+  tree ring_count = tls_var("cfcss_ring_count", unsigned_type_node);
+  FILE *map = nullptr;
+  cfcss_sig_t acc = 0;
+  basic_block bb;
+
+  if (!sigmap_path.empty()) {
+    map = fopen(sigmap_path.c_str(), "a");
+    if (!map)
+      std::cerr << "Control flow checking note: cannot open " << sigmap_path
+                << std::endl;
+  }
+
+  for (cgraph_node *node : functions) {
+    push_cfun(node->get_fun());
+    if (options_for(node).stable_signatures)
+      acc = signature_seed(node);
+    FOR_EACH_BB_FN (bb, cfun) {
+      cfcss_sig_t bb_sig = acc++;
+      auto gsi = gsi_after_labels(bb);
+      tree count = make_ssa_name(unsigned_type_node);
+      tree next = make_ssa_name(unsigned_type_node);
+      tree pos = make_ssa_name(unsigned_type_node);
+      tree slot = build4(ARRAY_REF, unsigned_char_type_node, ring, pos,
+                         NULL_TREE, NULL_TREE);
+
+      if (map)
+        write_sigmap_block(map, node, bb, bb_sig);
+
+      // ring[count & (size - 1)] = sig; count = count + 1;
+      gsi_insert_before(&gsi, gimple_build_assign(count, ring_count),
+                        GSI_SAME_STMT);
+      gsi_insert_before(&gsi, gimple_build_assign(
+                          pos, BIT_AND_EXPR, count,
+                          build_int_cst(unsigned_type_node, record_size - 1)),
+                        GSI_SAME_STMT);
+      gsi_insert_before(&gsi, gimple_build_assign(
+                          slot, build_int_cst(unsigned_char_type_node,
+                                              bb_sig)),
+                        GSI_SAME_STMT);
+      gsi_insert_before(&gsi, gimple_build_assign(
+                          next, PLUS_EXPR, count,
+                          build_int_cst(unsigned_type_node, 1)),
+                        GSI_SAME_STMT);
+      gsi_insert_before(&gsi, gimple_build_assign(ring_count, next),
+                        GSI_SAME_STMT);
+    }
+    mark_virtual_operands_for_renaming(cfun);
+    update_ssa(TODO_update_ssa_only_virtuals);
+    pop_cfun();
+  }
+  if (map)
+    fclose(map);
+}
+
+/**
+  * @return the function @param expr takes the address of, if any
+  */
+static cgraph_node *address_of_function(tree expr) {
+  if (TREE_CODE(expr) != ADDR_EXPR
+      || TREE_CODE(TREE_OPERAND(expr, 0)) != FUNCTION_DECL)
+    return nullptr;
+  return cgraph_node::get(TREE_OPERAND(expr, 0));
+}
+
+/**
+  * Adds the signal handlers @param functions install to @param handlers,
+  * i.e. the functions passed to signal() and those stored in the handler
+  * field of a struct sigaction. The runtime enters them with G = D = 0, so
+  * they cannot take the signature of a caller.
+  */
+static void find_signal_handlers(const std::vector<cgraph_node *> &functions,
+                                 std::set<cgraph_node *> &handlers) {
+  static const char *const install_funcs[] = {
+    "signal", "sigset", "bsd_signal", "sysv_signal"
+  };
+  static const char *const handler_fields[] = {
+    "sa_handler", "sa_sigaction", "__sa_handler", "__sa_sigaction"
+  };
+  basic_block bb;
+
+  for (cgraph_node *node : functions) {
+    if (options_for(node).signal_handler)
+      handlers.insert(node);
+    FOR_EACH_BB_FN (bb, node->get_fun())
+      for (auto gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi)) {
+        gimple *stmt = gsi_stmt(gsi);
+        cgraph_node *handler = nullptr;
+
+        if (is_gimple_call(stmt) && gimple_call_fndecl(stmt)
+            && gimple_call_num_args(stmt) == 2) {
+          const char *name =
+            IDENTIFIER_POINTER(DECL_NAME(gimple_call_fndecl(stmt)));
+          for (const char *func : install_funcs)
+            if (strcmp(name, func) == 0)
+              handler = address_of_function(gimple_call_arg(stmt, 1));
+        } else if (is_gimple_assign(stmt)
+                   && TREE_CODE(gimple_assign_lhs(stmt)) == COMPONENT_REF) {
+          tree field = TREE_OPERAND(gimple_assign_lhs(stmt), 1);
+          for (const char *name : handler_fields)
+            if (DECL_NAME(field)
+                && strcmp(IDENTIFIER_POINTER(DECL_NAME(field)), name) == 0)
+              handler = address_of_function(gimple_assign_rhs1(stmt));
+        }
+        if (handler && handler->has_gimple_body_p())
+          handlers.insert(handler);
+      }
+  }
+}
+
+/**
+  * Adds to @param seen the functions with bodies @param work reaches by
+  * direct calls, @param work included.
+  */
+static void reach_functions(std::vector<cgraph_node *> work,
+                            std::set<cgraph_node *> &seen) {
+  while (!work.empty()) {
+    cgraph_node *node = work.back();
+    work.pop_back();
+    if (!seen.insert(node).second)
+      continue;
+    for (auto it = node->callees; it != nullptr; it = it->next_callee)
+      if (it->callee->has_gimple_body_p())
+        work.push_back(it->callee);
+  }
+}
+
+/**
+  * Finds the functions of @param functions that only run before main(): the
+  * static constructors and the functions nothing else reaches. Those whose
+  * startup level is 2 and that only call functions of @param exempt go to
+  * @param exempt, the others with a startup level to @param entry_only.
+  */
+static void find_startup_functions(const std::vector<cgraph_node *> &functions,
+                                   std::set<cgraph_node *> &exempt,
+                                   std::set<cgraph_node *> &entry_only) {
+  std::vector<cgraph_node *> ctors, roots;
+  std::set<cgraph_node *> startup, after_startup;
+
+  // A function the rest of the program may call or take the address of can
+  // run at any time, and so can everything it reaches.
+  for (cgraph_node *node : functions)
+    if (DECL_STATIC_CONSTRUCTOR(node->decl))
+      ctors.push_back(node);
+    else if (!node->local || node->address_taken)
+      roots.push_back(node);
+  reach_functions(roots, after_startup);
+  reach_functions(ctors, startup);
+
+  for (cgraph_node *node : startup)
+    if (!after_startup.count(node) && options_for(node).startup_level == 2)
+      exempt.insert(node);
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto it = exempt.begin(); it != exempt.end();) {
+      bool calls_checked = false;
+      for (auto e = (*it)->callees; e != nullptr; e = e->next_callee)
+        if (e->callee->has_gimple_body_p() && !exempt.count(e->callee))
+          calls_checked = true;
+      if (calls_checked) {
+        it = exempt.erase(it);
+        changed = true;
+      } else {
+        ++it;
+      }
+    }
+  }
+  for (cgraph_node *node : startup)
+    if (!after_startup.count(node) && !exempt.count(node)
+        && options_for(node).startup_level != 0)
+      entry_only.insert(node);
+}
+
+/**
+  * Adds the functions of @param functions with boundary signatures to
+  * @param boundary, along with the instrumented functions they reach by
+  * direct calls: a callee bound to the signatures inside a boundary function
+  * would have to change with it. Signal handlers and the functions of
+  * @param exempt are entered without them and so are left out.
+  */
+static void find_boundary_functions(
+    const std::vector<cgraph_node *> &functions,
+    const std::set<cgraph_node *> &handlers,
+    const std::set<cgraph_node *> &exempt,
+    std::set<cgraph_node *> &boundary) {
+  std::vector<cgraph_node *> work;
+
+  for (cgraph_node *node : functions)
+    if (options_for(node).boundary_signatures && !exempt.count(node))
+      work.push_back(node);
+  while (!work.empty()) {
+    cgraph_node *node = work.back();
+    work.pop_back();
+    if (!boundary.insert(node).second)
+      continue;
+    for (auto it = node->callees; it != nullptr; it = it->next_callee) {
+      cgraph_node *callee = it->callee;
+      if (!callee->has_gimple_body_p() || handlers.count(callee)
+          || exempt.count(callee) || boundary.count(callee))
+        continue;
+      if (!options_for(callee).boundary_signatures && dump_enabled_p())
+        dump_printf_loc(MSG_NOTE, it->call_stmt,
+                        "%s gets boundary signatures because %s has "
+                        "them\n", callee->name(), node->name());
+      work.push_back(callee);
+    }
+  }
+}
+
+/**
+  * @return the number of statements of @param bb, instrumentation excluded
+  */
+static long num_stmts(basic_block bb) {
+  long num = 0;
+  for (auto gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi))
+    if (!is_gimple_debug(gsi_stmt(gsi))
+        && gimple_code(gsi_stmt(gsi)) != GIMPLE_LABEL
+        && !is_cfcss_asm(gsi_stmt(gsi)))
+      ++num;
+  return num;
+}
+
+/**
+  * @return the representative of the tree of @param bb in @param parent
+  */
+static basic_block tree_root(std::map<basic_block, basic_block> &parent,
+                             basic_block bb) {
+  auto it = parent.find(bb);
+  if (it == parent.end() || it->second == bb)
+    return bb;
+  return it->second = tree_root(parent, it->second);
+}
+
+/**
+  * Chooses the blocks of @param node that go without a check, in the manner
+  * of optimal edge-profile placement. The edges into those blocks form a
+  * maximum-weight spanning forest of the CFG, grown greedily by the count of
+  * the block whose check they remove, so every cycle keeps a check. All the
+  * blocks of a tree share one signature: the unchecked ones leave G alone,
+  * and the checks off the forest, the chords, make all the signature
+  * updates. Blocks in @param fixed keep their check and signature, and so do
+  * the blocks whose successors need D from them. A tree spans at most
+  * @param max_stmts statements, unless it is 0.
+  * @return in @param unchecked, the blocks without a check, and in
+  * @param sig_of, the blocks of each tree but one mapped to that one
+  */
+static void find_unchecked_blocks(cgraph_node *node, size_t max_stmts,
+                                  const std::set<basic_block> &fixed,
+                                  std::set<basic_block> &unchecked,
+                                  std::map<basic_block, basic_block> &sig_of) {
+  function *fun = node->get_fun();
+  std::vector<std::pair<gcov_type, basic_block>> order;
+  std::map<basic_block, basic_block> parent;
+  std::map<basic_block, long> tree_stmts;
+  basic_block bb;
+
+  auto stmts_of = [&](basic_block root) {
+    if (!tree_stmts.count(root))
+      tree_stmts[root] = num_stmts(root);
+    return tree_stmts[root];
+  };
+
+  FOR_EACH_BB_FN (bb, fun)
+    order.push_back(std::make_pair(
+      bb->count.initialized_p() ? bb->count.to_gcov_type() : 0, bb));
+  std::stable_sort(order.begin(), order.end(),
+                   [](const std::pair<gcov_type, basic_block> &a,
+                      const std::pair<gcov_type, basic_block> &b) {
+                     return a.first > b.first;
+                   });
+
+  for (auto &entry : order) {
+    bb = entry.second;
+    if (fixed.count(bb) || bb == ENTRY_BLOCK_PTR_FOR_FN(fun)->next_bb)
+      continue;
+
+    // Without a check, the block cannot set D for its successors.
+    bool ok = true;
+    for (edge succ : *bb->succs)
+      ok = ok && (succ->dest == EXIT_BLOCK_PTR_FOR_FN(fun)
+                  || single_pred_p(succ->dest));
+
+    // All the edges into the block join the forest, so they must not close
+    // a cycle.
+    basic_block own = tree_root(parent, bb);
+    std::set<basic_block> roots;
+    long stmts = stmts_of(own);
+    for (edge pred : *bb->preds) {
+      if (!ok)
+        break;
+      basic_block root = tree_root(parent, pred->src);
+      ok = pred->src != ENTRY_BLOCK_PTR_FOR_FN(fun) && !fixed.count(pred->src)
+           && !(pred->flags & (EDGE_ABNORMAL | EDGE_EH))
+           && root != own && roots.insert(root).second;
+      stmts += stmts_of(root);
+    }
+    if (!ok || roots.empty()
+        || (max_stmts != 0 && stmts > (long) max_stmts))
+      continue;
+
+    for (basic_block root : roots)
+      parent[root] = own;
+    tree_stmts[own] = stmts;
+    unchecked.insert(bb);
+  }
+
+  // Prefer a checked block for the signature of a tree.
+  std::map<basic_block, basic_block> rep;
+  FOR_EACH_BB_FN (bb, fun)
+    if (!unchecked.count(bb))
+      rep.insert(std::make_pair(tree_root(parent, bb), bb));
+  FOR_EACH_BB_FN (bb, fun)
+    if (rep[tree_root(parent, bb)] != bb)
+      sig_of[bb] = rep[tree_root(parent, bb)];
+}
+
+/**
+  * @return whether @param a and @param b match in the values @param defs
+  * maps the names defined by the first block to
+  */
+static bool same_value(tree a, tree b, const std::map<tree, tree> &defs) {
+  auto it = defs.find(a);
+  if (it != defs.end())
+    return it->second == b;
+  return a == b || (a && b && operand_equal_p(a, b, 0));
+}
+
+/**
+  * @return whether blocks @param a and @param b do the same and continue
+  * the same way, i.e. whether cross-jumping could fold them into one
+  */
+static bool same_tail(basic_block a, basic_block b) {
+  std::map<tree, tree> defs;
+
+  if (a->succs->length() != b->succs->length()
+      || !gimple_seq_empty_p(phi_nodes(a))
+      || !gimple_seq_empty_p(phi_nodes(b)))
+    return false;
+
+  auto gsi_a = gsi_start_nondebug_after_labels_bb(a);
+  auto gsi_b = gsi_start_nondebug_after_labels_bb(b);
+  for (; !gsi_end_p(gsi_a) && !gsi_end_p(gsi_b);
+       gsi_next_nondebug(&gsi_a), gsi_next_nondebug(&gsi_b)) {
+    gimple *stmt_a = gsi_stmt(gsi_a);
+    gimple *stmt_b = gsi_stmt(gsi_b);
+    tree lhs_a = gimple_get_lhs(stmt_a);
+    tree lhs_b = gimple_get_lhs(stmt_b);
+
+    if (gimple_code(stmt_a) != gimple_code(stmt_b)
+        || gimple_code(stmt_a) == GIMPLE_ASM
+        || gimple_expr_code(stmt_a) != gimple_expr_code(stmt_b)
+        || gimple_num_ops(stmt_a) != gimple_num_ops(stmt_b))
+      return false;
+    // A name defined in the block stands for the one defined in its place
+    // by the other block.
+    bool local_def = lhs_a && TREE_CODE(lhs_a) == SSA_NAME;
+    if (local_def && (!lhs_b || TREE_CODE(lhs_b) != SSA_NAME))
+      return false;
+    for (unsigned i = 0; i < gimple_num_ops(stmt_a); ++i)
+      if (!(local_def && gimple_op(stmt_a, i) == lhs_a)
+          && !same_value(gimple_op(stmt_a, i), gimple_op(stmt_b, i), defs))
+        return false;
+    if (local_def)
+      defs[lhs_a] = lhs_b;
+  }
+  if (!gsi_end_p(gsi_a) || !gsi_end_p(gsi_b))
+    return false;
+
+  // The successors must not tell the two blocks apart either. Virtual
+  // operands are left to the merging passes.
+  for (unsigned i = 0; i < a->succs->length(); ++i) {
+    edge edge_a = (*a->succs)[i];
+    edge edge_b = (*b->succs)[i];
+    int kind = EDGE_FALLTHRU | EDGE_TRUE_VALUE | EDGE_FALSE_VALUE;
+    if (edge_a->dest != edge_b->dest
+        || (edge_a->flags & kind) != (edge_b->flags & kind)
+        || ((edge_a->flags | edge_b->flags) & (EDGE_ABNORMAL | EDGE_EH)))
+      return false;
+    for (auto gsi = gsi_start_phis(edge_a->dest); !gsi_end_p(gsi);
+         gsi_next(&gsi)) {
+      gphi *phi = gsi.phi();
+      if (!virtual_operand_p(gimple_phi_result(phi))
+          && !same_value(PHI_ARG_DEF_FROM_EDGE(phi, edge_a),
+                         PHI_ARG_DEF_FROM_EDGE(phi, edge_b), defs))
+        return false;
+    }
+  }
+  return true;
+}
+
+/**
+  * Finds the blocks of @param node that cross-jumping could fold into one
+  * but for their checks, such as identical error returns. The blocks of a
+  * group get one signature and check against one base predecessor, which
+  * the predecessors of all of them adjust to with D, so that their checks
+  * come out the same. A predecessor cannot set D
+  * for anything else at the same time, so each must leave only for blocks
+  * of the group or for blocks it is the only predecessor of. Blocks in
+  * @param fixed and @param unchecked are left alone.
+  * @return in @param base, the blocks of each group mapped to the base
+  * predecessor, and in @param sig_of, the blocks of each group but the first
+  * mapped to the first; @param num_unified counts the latter
+  */
+static void find_merge_groups(cgraph_node *node,
+                              const std::set<basic_block> &fixed,
+                              const std::set<basic_block> &unchecked,
+                              std::map<basic_block, basic_block> &base,
+                              std::map<basic_block, basic_block> &sig_of,
+                              size_t &num_unified, bool remark) {
+  function *fun = node->get_fun();
+  std::map<std::pair<std::vector<int>, long>,
+           std::vector<std::vector<basic_block>>> buckets;
+  std::map<basic_block, size_t> group_of;
+  std::vector<std::vector<basic_block>> groups;
+  basic_block bb;
+
+  FOR_EACH_BB_FN (bb, fun) {
+    long stmts = num_stmts(bb);
+    if (fixed.count(bb) || unchecked.count(bb) || stmts == 0
+        || bb->preds->length() == 0
+        || bb == ENTRY_BLOCK_PTR_FOR_FN(fun)->next_bb)
+      continue;
+    std::vector<int> succs;
+    for (edge succ : *bb->succs)
+      succs.push_back(succ->dest->index);
+    auto &candidates = buckets[std::make_pair(succs, stmts)];
+    auto it = candidates.begin();
+    while (it != candidates.end() && !same_tail(it->front(), bb))
+      ++it;
+    if (it == candidates.end())
+      candidates.push_back(std::vector<basic_block>(1, bb));
+    else
+      it->push_back(bb);
+  }
+  for (auto &bucket : buckets)
+    for (auto &group : bucket.second)
+      if (group.size() >= 2) {
+        for (basic_block member : group)
+          group_of[member] = groups.size();
+        groups.push_back(group);
+      }
+
+  for (size_t i = 0; i < groups.size(); ++i) {
+    bool ok = true;
+    for (basic_block member : groups[i])
+      for (edge pred : *member->preds) {
+        basic_block src = pred->src;
+        ok = ok && src != ENTRY_BLOCK_PTR_FOR_FN(fun) && !fixed.count(src)
+             && !unchecked.count(src) && !group_of.count(src)
+             && !(pred->flags & (EDGE_ABNORMAL | EDGE_EH));
+        for (edge succ : *src->succs) {
+          auto it = group_of.find(succ->dest);
+          ok = ok && (it != group_of.end() ? it->second == i
+                                           : single_pred_p(succ->dest));
+        }
+      }
+    if (!ok)
+      continue;
+
+    basic_block first = groups[i].front();
+    for (basic_block member : groups[i]) {
+      base[member] = (*first->preds)[0]->src;
+      if (member != first)
+        sig_of[member] = first;
+    }
+    num_unified += groups[i].size() - 1;
+    if (remark && dump_enabled_p())
+      dump_printf_loc(MSG_OPTIMIZED_LOCATIONS, block_location(first, fun),
+                      "gave %u blocks identical to this one its signature "
+                      "so that they can be merged\n",
+                      (unsigned) groups[i].size() - 1);
+  }
+}
+
+/**
+  * Counts the acyclic paths from @param bb to the exit in the manner of Ball
+  * and Larus: a back edge ends a path like an edge to the exit, and paths
+  * start again at its target. Each edge gets in @param inc the number of
+  * paths through the successors before it, so that the increments along a
+  * path add up to an ID no other path has. @param order receives the blocks
+  * in post-order.
+  * @return the number of paths, or 0 if there are more than max_paths
+  */
+static uint64_t count_paths(basic_block bb,
+                            std::map<basic_block, uint64_t> &paths,
+                            std::map<edge, uint64_t> &inc,
+                            std::vector<basic_block> &order) {
+  auto it = paths.find(bb);
+  if (it != paths.end())
+    return it->second;
+
+  uint64_t num = 0;
+  for (edge succ : *bb->succs) {
+    uint64_t succ_paths = 1;
+    inc[succ] = num;
+    if (!(succ->flags & EDGE_DFS_BACK)
+        && succ->dest->index >= NUM_FIXED_BLOCKS)
+      succ_paths = count_paths(succ->dest, paths, inc, order);
+    if (succ_paths == 0 || num + succ_paths > max_paths)
+      return paths[bb] = 0;
+    num += succ_paths;
+  }
+  order.push_back(bb);
+  // A block without successors, e.g. one ending with a noreturn call, ends
+  // a path of its own.
+  return paths[bb] = std::max(num, (uint64_t) 1);
+}
+
+/**
+  * Adds the values of @param from to @param into.
+  */
+static void merge_range(path_range &into, const path_range &from) {
+  uint64_t lo = std::min(into.lo, from.lo);
+  uint64_t hi = std::max(into.hi, from.hi);
+
+  // Bit 63 stays clear, so that the check can clamp the shift to 63.
+  into.mask = hi - lo < 63
+              ? into.mask << (into.lo - lo) | from.mask << (from.lo - lo) : 0;
+  into.lo = lo;
+  into.hi = hi;
+}
+
+/**
+  * Splits the block @param bb of @param node after the condition
+  * @param cond it ends with, and calls @param error_fn where it holds. The
+  * error handler may return, e.g. after logging the error, so the failing
+  * path joins the passing one again.
+  */
+static void branch_to_error(cgraph_node *node, basic_block bb, gcond *cond,
+                            tree error_fn) {
+  edge pass = split_block(bb, cond);
+  basic_block fail = create_empty_bb(bb);
+  gcall *call = gimple_build_call(error_fn, 0);
+  auto fail_gsi = gsi_start_bb(fail);
+  gsi_insert_after(&fail_gsi, call, GSI_NEW_STMT);
+  node->create_edge(cgraph_node::get_create(error_fn), call,
+                    profile_count::zero());
+  fail->count = profile_count::zero();
+  if (current_loops)
+    add_bb_to_loop(fail, bb->loop_father);
+
+  pass->flags = (pass->flags & ~EDGE_FALLTHRU) | EDGE_FALSE_VALUE;
+  pass->probability = profile_probability::always();
+  edge to_fail = make_edge(bb, fail, EDGE_TRUE_VALUE);
+  to_fail->probability = profile_probability::never();
+  make_single_succ_edge(fail, pass->dest, EDGE_FALLTHRU);
+}
+
+/**
+  * Inserts before @param stmt of @param node a check that the path ID in
+  * @param path is one of the values of @param range, with a call of
+  * @param error_fn if it is not. The block of @param stmt is split after the
+  * check.
+  */
+static void insert_path_check(cgraph_node *node, gimple *stmt, tree path,
+                              const path_range &range, tree error_fn) {
+  basic_block bb = stmt->bb;
+  auto gsi = gsi_for_stmt(stmt);
+  tree val = make_ssa_name(unsigned_type_node);
+  tree off = make_ssa_name(unsigned_type_node);
+  gcond *cond;
+
+  gsi_insert_before(&gsi, gimple_build_assign(val, path), GSI_SAME_STMT);
+  gsi_insert_before(&gsi, gimple_build_assign(
+                      off, MINUS_EXPR, val,
+                      build_int_cst(unsigned_type_node, range.lo)),
+                    GSI_SAME_STMT);
+
+  // A range with holes tests the bit of the offset in the mask; a range
+  // without holes needs a compare only.
+  if (range.mask
+      && range.mask != ((uint64_t) 2 << (range.hi - range.lo)) - 1) {
+    tree shift = make_ssa_name(unsigned_type_node);
+    tree bits = make_ssa_name(long_long_unsigned_type_node);
+    tree bit = make_ssa_name(long_long_unsigned_type_node);
+    gsi_insert_before(&gsi, gimple_build_assign(
+                        shift, MIN_EXPR, off,
+                        build_int_cst(unsigned_type_node, 63)),
+                      GSI_SAME_STMT);
+    gsi_insert_before(&gsi, gimple_build_assign(
+                        bits, RSHIFT_EXPR,
+                        build_int_cstu(long_long_unsigned_type_node,
+                                       range.mask), shift),
+                      GSI_SAME_STMT);
+    gsi_insert_before(&gsi, gimple_build_assign(
+                        bit, BIT_AND_EXPR, bits,
+                        build_int_cst(long_long_unsigned_type_node, 1)),
+                      GSI_SAME_STMT);
+    cond = gimple_build_cond(EQ_EXPR, bit,
+                             build_int_cst(long_long_unsigned_type_node, 0),
+                             NULL_TREE, NULL_TREE);
+  } else {
+    cond = gimple_build_cond(GT_EXPR, off,
+                             build_int_cst(unsigned_type_node,
+                                           range.hi - range.lo),
+                             NULL_TREE, NULL_TREE);
+  }
+  gsi_insert_before(&gsi, cond, GSI_SAME_STMT);
+  branch_to_error(node, bb, cond, error_fn);
+}
+
+/**
+  * @return the byte block @param bb adds to the path hash
+  */
+static unsigned char path_tag(basic_block bb) {
+  return bb->index & 0xff;
+}
+
+/**
+  * @return @param crc advanced by the byte @param data, as
+  * __builtin_crc32_data8 and the cfcss_crc_table of the runtime do it
+  */
+static uint32_t crc_step(uint32_t crc, unsigned char data) {
+  crc ^= (uint32_t) data << 24;
+  for (int i = 0; i < 8; ++i)
+    crc = crc & 0x80000000u ? crc << 1 ^ crc_poly : crc << 1;
+  return crc;
+}
+
+/**
+  * @return the CRC builtin of GCC 15 and later, which expands to carry-less
+  * multiplies on targets with Zbc and to a table lookup elsewhere, or
+  * NULL_TREE if the compiler has none
+  */
+static tree crc_builtin() {
+#if GCCPLUGIN_VERSION_MAJOR >= 15
+  return builtin_decl_explicit(BUILT_IN_CRC32_DATA8);
+#else
+  return NULL_TREE;
+#endif
+}
+
+/**
+  * Walks the acyclic paths on from @param bb, which arrive with the path ID
+  * @param id and the path hash @param hash, and records in @param expected
+  * the hash each path has where it is checked: before a return and on a
+  * back edge, by block and path ID.
+  */
+static void hash_paths(basic_block bb, uint64_t id, uint32_t hash,
+                       std::map<edge, uint64_t> &inc,
+                       std::map<basic_block,
+                                std::map<uint64_t, uint32_t>> &expected) {
+  hash = crc_step(hash, path_tag(bb));
+  if (return_stmt(bb))
+    expected[bb][id] = hash;
+  for (edge succ : *bb->succs)
+    if (succ->flags & EDGE_DFS_BACK)
+      expected[bb][id] = hash;
+    else if (succ->dest->index >= NUM_FIXED_BLOCKS)
+      hash_paths(succ->dest, id + inc[succ], hash, inc, expected);
+}
+
+/**
+  * @return a new read-only array of @param values, local to the module
+  */
+static tree hash_table(const std::vector<uint32_t> &values) {
+  tree type = build_array_type_nelts(unsigned_type_node, values.size());
+  tree decl = build_decl(UNKNOWN_LOCATION, VAR_DECL,
+                         create_tmp_var_name("cfcss_hashes"), type);
+  vec<constructor_elt, va_gc> *elts = nullptr;
+
+  for (size_t i = 0; i < values.size(); ++i)
+    CONSTRUCTOR_APPEND_ELT(elts, size_int(i),
+                           build_int_cstu(unsigned_type_node, values[i]));
+  TREE_STATIC(decl) = 1;
+  TREE_READONLY(decl) = 1;
+  DECL_ARTIFICIAL(decl) = 1;
+  DECL_IGNORED_P(decl) = 1;
+  DECL_INITIAL(decl) = build_constructor(type, elts);
+  varpool_node::finalize_decl(decl);
+  return decl;
+}
+
+/**
+  * Inserts at the start of @param bb of @param node the CRC step that adds
+  * the tag of the block to the path hash @param hash: a call of
+  * @param crc_fn if there is one, a lookup in @param crc_table otherwise.
+  */
+static void insert_hash_update(cgraph_node *node, basic_block bb, tree hash,
+                               tree crc_fn, tree crc_table) {
+  auto gsi = gsi_after_labels(bb);
+  tree old_val = make_ssa_name(unsigned_type_node);
+  tree new_val = make_ssa_name(unsigned_type_node);
+
+  gsi_insert_before(&gsi, gimple_build_assign(old_val, hash), GSI_SAME_STMT);
+  if (crc_fn) {
+    gcall *call = gimple_build_call(crc_fn, 3, old_val,
+                                    build_int_cst(unsigned_char_type_node,
+                                                  path_tag(bb)),
+                                    build_int_cst(unsigned_type_node,
+                                                  crc_poly));
+    gimple_call_set_lhs(call, new_val);
+    gsi_insert_before(&gsi, call, GSI_SAME_STMT);
+    node->create_edge(cgraph_node::get_create(crc_fn), call, bb->count);
+  } else {
+    // hash = hash << 8 ^ crc_table[hash >> 24 ^ tag];
+    tree top = make_ssa_name(unsigned_type_node);
+    tree idx = make_ssa_name(unsigned_type_node);
+    tree entry = make_ssa_name(unsigned_type_node);
+    tree shifted = make_ssa_name(unsigned_type_node);
+    gsi_insert_before(&gsi, gimple_build_assign(
+                        top, RSHIFT_EXPR, old_val,
+                        build_int_cst(unsigned_type_node, 24)),
+                      GSI_SAME_STMT);
+    gsi_insert_before(&gsi, gimple_build_assign(
+                        idx, BIT_XOR_EXPR, top,
+                        build_int_cst(unsigned_type_node, path_tag(bb))),
+                      GSI_SAME_STMT);
+    gsi_insert_before(&gsi, gimple_build_assign(
+                        entry, build4(ARRAY_REF, unsigned_type_node,
+                                      crc_table, idx, NULL_TREE,
+                                      NULL_TREE)),
+                      GSI_SAME_STMT);
+    gsi_insert_before(&gsi, gimple_build_assign(
+                        shifted, LSHIFT_EXPR, old_val,
+                        build_int_cst(unsigned_type_node, 8)),
+                      GSI_SAME_STMT);
+    gsi_insert_before(&gsi, gimple_build_assign(
+                        new_val, BIT_XOR_EXPR, shifted, entry),
+                      GSI_SAME_STMT);
+  }
+  gsi_insert_before(&gsi, gimple_build_assign(hash, new_val), GSI_SAME_STMT);
+}
+
+/**
+  * Inserts before @param stmt of @param node a check that the path hash in
+  * @param hash is the one @param table holds for the path ID in @param path,
+  * less @param lo, with a call of @param error_fn if it is not. IDs beyond
+  * the table read its last entry; the check of the ID rejects them anyway.
+  * The block of @param stmt is split after the check.
+  */
+static void insert_hash_check(cgraph_node *node, gimple *stmt, tree path,
+                              tree hash, uint64_t lo, tree table,
+                              size_t size, tree error_fn) {
+  basic_block bb = stmt->bb;
+  auto gsi = gsi_for_stmt(stmt);
+  tree val = make_ssa_name(unsigned_type_node);
+  tree off = make_ssa_name(unsigned_type_node);
+  tree idx = make_ssa_name(unsigned_type_node);
+  tree want = make_ssa_name(unsigned_type_node);
+  tree got = make_ssa_name(unsigned_type_node);
+
+  gsi_insert_before(&gsi, gimple_build_assign(val, path), GSI_SAME_STMT);
+  gsi_insert_before(&gsi, gimple_build_assign(
+                      off, MINUS_EXPR, val,
+                      build_int_cst(unsigned_type_node, lo)),
+                    GSI_SAME_STMT);
+  gsi_insert_before(&gsi, gimple_build_assign(
+                      idx, MIN_EXPR, off,
+                      build_int_cst(unsigned_type_node, size - 1)),
+                    GSI_SAME_STMT);
+  gsi_insert_before(&gsi, gimple_build_assign(
+                      want, build4(ARRAY_REF, unsigned_type_node, table, idx,
+                                   NULL_TREE, NULL_TREE)),
+                    GSI_SAME_STMT);
+  gsi_insert_before(&gsi, gimple_build_assign(got, hash), GSI_SAME_STMT);
+  gcond *cond = gimple_build_cond(NE_EXPR, got, want, NULL_TREE, NULL_TREE);
+  gsi_insert_before(&gsi, cond, GSI_SAME_STMT);
+  branch_to_error(node, bb, cond, error_fn);
+}
+
+/**
+  * Path-ID checking of @param node: the acyclic paths of the function are
+  * numbered Ball-Larus style and a local variable accumulates the ID of the
+  * path taken so far, with one add on each edge whose increment is not 0.
+  * Only the back edges and the returns check the ID, against the values the
+  * paths reaching them can have, and call @param error_fn if it is none of
+  * them; a back edge then starts the ID of the paths from the loop header.
+  * A jump out of the CFG mixes the increments of two paths into a sum that
+  * the next check rejects unless some path happens to have it. With
+  * @param hash, every block also adds a tag to a CRC of the path, and the
+  * checks compare it with the one the path ID calls for, from a table per
+  * check, so that a jump that keeps the ID valid is caught as well. Without
+  * the CRC builtin, the updates look up @param crc_table. The adds, updates
+  * and checks are counted in @param st.
+  * @return false if the paths cannot be numbered
+  */
+static bool add_path_checks(cgraph_node *node, tree error_fn, bool hash,
+                            tree crc_table, bool remark, cfcss_stats &st) {
+  function *fun = node->get_fun();
+  basic_block first = single_succ(ENTRY_BLOCK_PTR_FOR_FN(fun));
+  auto fun_loc = dump_user_location_t::from_function_decl(fun->decl);
+  std::map<basic_block, uint64_t> paths;
+  std::map<edge, uint64_t> inc;
+  std::map<basic_block, path_range> ranges;
+  std::vector<basic_block> order;
+  std::vector<edge> back_edges;
+  std::vector<std::pair<gimple *, path_range>> path_checks;
+  std::vector<basic_block> check_blocks;
+  std::map<basic_block, std::map<uint64_t, uint32_t>> expected;
+  bool abnormal = false;
+  basic_block bb;
+
+  push_cfun(fun);
+  mark_dfs_back_edges();
+  FOR_EACH_BB_FN (bb, fun)
+    for (edge succ : *bb->succs) {
+      abnormal = abnormal || (succ->flags & (EDGE_ABNORMAL | EDGE_EH));
+      if (succ->flags & EDGE_DFS_BACK)
+        back_edges.push_back(succ);
+    }
+
+  // The paths from the entry come first, then those from the target of
+  // each back edge.
+  std::vector<uint64_t> restart(back_edges.size());
+  uint64_t num = abnormal ? 0 : count_paths(first, paths, inc, order);
+  for (size_t i = 0; i < back_edges.size() && num != 0; ++i) {
+    uint64_t header_paths = count_paths(back_edges[i]->dest, paths, inc,
+                                        order);
+    restart[i] = num;
+    num = header_paths == 0 || num + header_paths > max_paths
+          ? 0 : num + header_paths;
+  }
+  if (num == 0) {
+    if (remark && dump_enabled_p() && abnormal)
+      dump_printf_loc(MSG_MISSED_OPTIMIZATION, fun_loc,
+                      "could not check path IDs in %s because of its "
+                      "abnormal edges\n", node->name());
+    else if (remark && dump_enabled_p())
+      dump_printf_loc(MSG_MISSED_OPTIMIZATION, fun_loc,
+                      "could not check path IDs in %s because it has more "
+                      "than %u acyclic paths\n", node->name(),
+                      (unsigned) max_paths);
+    pop_cfun();
+    return false;
+  }
+
+  // The IDs a block may see, in topological order.
+  ranges[first] = { 0, 0, 1 };
+  for (size_t i = 0; i < back_edges.size(); ++i) {
+    path_range start = { restart[i], restart[i], 1 };
+    auto it = ranges.find(back_edges[i]->dest);
+    if (it == ranges.end())
+      ranges[back_edges[i]->dest] = start;
+    else
+      merge_range(it->second, start);
+  }
+  for (auto it = order.rbegin(); it != order.rend(); ++it) {
+    path_range range = ranges[*it];
+    for (edge succ : *(*it)->succs) {
+      if ((succ->flags & EDGE_DFS_BACK)
+          || succ->dest->index < NUM_FIXED_BLOCKS)
+        continue;
+      path_range next = { range.lo + inc[succ], range.hi + inc[succ],
+                          range.mask };
+      auto jt = ranges.find(succ->dest);
+      if (jt == ranges.end())
+        ranges[succ->dest] = next;
+      else
+        merge_range(jt->second, next);
+    }
+  }
+
+  // The hash each path arrives with at each check.
+  if (hash && num > max_hashed_paths) {
+    if (remark && dump_enabled_p())
+      dump_printf_loc(MSG_MISSED_OPTIMIZATION, fun_loc,
+                      "could not hash the paths of %s because it has more "
+                      "than %u acyclic paths; checking path IDs only\n",
+                      node->name(), (unsigned) max_hashed_paths);
+    hash = false;
+  }
+  if (hash) {
+    hash_paths(first, 0, crc_init, inc, expected);
+    for (size_t i = 0; i < back_edges.size(); ++i)
+      hash_paths(back_edges[i]->dest, restart[i], crc_init, inc, expected);
+  }
+
+  // Kept in memory, like the ring of the flight recorder, so that only the
+  // virtual operands need renaming. The address is never taken, so the
+  // variables become registers again.
+  tree path = create_tmp_var(unsigned_type_node, "cfcss_path");
+  TREE_ADDRESSABLE(path) = 1;
+
+  gsi_insert_on_edge(single_succ_edge(ENTRY_BLOCK_PTR_FOR_FN(fun)),
+                     gimple_build_assign(path,
+                                         build_int_cst(unsigned_type_node,
+                                                       0)));
+  for (basic_block block : order)
+    for (edge succ : *block->succs) {
+      if ((succ->flags & EDGE_DFS_BACK)
+          || succ->dest->index < NUM_FIXED_BLOCKS || inc[succ] == 0)
+        continue;
+      tree old_val = make_ssa_name(unsigned_type_node);
+      tree new_val = make_ssa_name(unsigned_type_node);
+      gsi_insert_on_edge(succ, gimple_build_assign(old_val, path));
+      gsi_insert_on_edge(succ, gimple_build_assign(
+                                 new_val, PLUS_EXPR, old_val,
+                                 build_int_cst(unsigned_type_node,
+                                               inc[succ])));
+      gsi_insert_on_edge(succ, gimple_build_assign(path, new_val));
+      ++st.path_adds;
+    }
+
+  tree hash_var = NULL_TREE;
+  if (hash) {
+    tree crc_fn = crc_builtin();
+    hash_var = create_tmp_var(unsigned_type_node, "cfcss_hash");
+    TREE_ADDRESSABLE(hash_var) = 1;
+    gsi_insert_on_edge(single_succ_edge(ENTRY_BLOCK_PTR_FOR_FN(fun)),
+                       gimple_build_assign(hash_var,
+                                           build_int_cstu(unsigned_type_node,
+                                                          crc_init)));
+    for (basic_block block : order) {
+      insert_hash_update(node, block, hash_var, crc_fn, crc_table);
+      ++st.hash_updates;
+    }
+  }
+
+  FOR_EACH_BB_FN (bb, fun)
+    if (return_stmt(bb) && ranges.count(bb)) {
+      path_checks.push_back(std::make_pair(return_stmt(bb), ranges[bb]));
+      check_blocks.push_back(bb);
+    }
+  for (size_t i = 0; i < back_edges.size(); ++i) {
+    path_range range = ranges[back_edges[i]->src];
+    gimple *reset = gimple_build_assign(path,
+                                        build_int_cst(unsigned_type_node,
+                                                      restart[i]));
+    check_blocks.push_back(back_edges[i]->src);
+    bb = split_edge(back_edges[i]);
+    auto gsi = gsi_start_bb(bb);
+    gsi_insert_before(&gsi, reset, GSI_NEW_STMT);
+    if (hash)
+      gsi_insert_after(&gsi, gimple_build_assign(
+                              hash_var, build_int_cstu(unsigned_type_node,
+                                                       crc_init)),
+                       GSI_NEW_STMT);
+    path_checks.push_back(std::make_pair(reset, range));
+  }
+  gsi_commit_edge_inserts();
+
+  for (size_t i = 0; i < path_checks.size(); ++i) {
+    const path_range &range = path_checks[i].second;
+    insert_path_check(node, path_checks[i].first, path, range, error_fn);
+    if (!hash)
+      continue;
+    // IDs no path reaching the check has never pass the check of the ID.
+    std::vector<uint32_t> values(range.hi - range.lo + 1, 0);
+    for (auto &pair : expected[check_blocks[i]])
+      values[pair.first - range.lo] = pair.second;
+    insert_hash_check(node, path_checks[i].first, path, hash_var, range.lo,
+                      hash_table(values), values.size(), error_fn);
+    ++st.hash_checks;
+  }
+
+  if (remark && dump_enabled_p())
+    dump_printf_loc(MSG_OPTIMIZED_LOCATIONS, fun_loc,
+                    "checked %s by path ID%s: %u acyclic paths, %u checks "
+                    "at %u back edges and %u returns\n", node->name(),
+                    hash ? " and hash" : "",
+                    (unsigned) num, (unsigned) path_checks.size(),
+                    (unsigned) back_edges.size(),
+                    (unsigned) (path_checks.size() - back_edges.size()));
+
+  mark_virtual_operands_for_renaming(cfun);
+  update_ssa(TODO_update_ssa_only_virtuals);
+  free_dominance_info(CDI_DOMINATORS);
+  pop_cfun();
+  st.path_checks += path_checks.size();
+  return true;
+}
+
+/**
+  * @return the most statements executed from the start of @param bb to the
+  * next check, or -1 if a cycle of unchecked blocks makes it unbounded
+  */
+static long unchecked_run(basic_block bb,
+                          const std::map<basic_block, cfcss_check> &checks,
+                          std::map<basic_block, long> &memo) {
+  auto it = memo.find(bb);
+  if (it != memo.end())
+    return it->second == -2 ? -1 : it->second;
+
+  // -2 marks the blocks being visited.
+  memo[bb] = -2;
+  long longest = 0;
+  for (edge succ : *bb->succs) {
+    if (succ->dest->index < NUM_FIXED_BLOCKS || checks.count(succ->dest))
+      continue;
+    long run = unchecked_run(succ->dest, checks, memo);
+    if (run < 0) {
+      longest = -1;
+      break;
+    }
+    longest = std::max(longest, run);
+  }
+  return memo[bb] = longest < 0 ? -1 : longest + num_stmts(bb);
+}
+
+/**
+  * Adds the static protection metrics of @param fun to @param st. A jump
+  * from a checked block to a block that is not its successor is detected if
+  * the check of the target rejects the state the source leaves behind.
+  * @param sig_count is the number of blocks of the module per signature.
+  */
+static void measure_coverage(function *fun,
+                             const std::map<basic_block, cfcss_check> &checks,
+                             const size_t sig_count[256], cfcss_stats &st) {
+  // The number of checked blocks with a given S ^ d, for ctrlsig_s and
+  // ctrlsig_m. A jump leaving G = S' and D = D' is accepted by the ctrlsig_s
+  // blocks with S ^ d = S' and by the ctrlsig_m blocks with S ^ d = S' ^ D'.
+  size_t keys[2][256] = {};
+  size_t num_blocks = 0, num_unchecked = 0;
+  std::map<basic_block, long> memo;
+  basic_block bb;
+
+  FOR_EACH_BB_FN (bb, fun) {
+    auto it = checks.find(bb);
+    ++num_blocks;
+    if (it == checks.end()) {
+      ++num_unchecked;
+      continue;
+    }
+    ++keys[it->second.multi][it->second.S ^ it->second.d];
+    if (sig_count[it->second.S] > 1)
+      ++st.aliased_blocks;
+  }
+
+  FOR_EACH_BB_FN (bb, fun) {
+    auto it = checks.find(bb);
+    bool entered = checks.count(bb)
+                   || (single_pred_p(bb)
+                       && single_pred(bb) == ENTRY_BLOCK_PTR_FOR_FN(fun));
+
+    // A run of unchecked code starts at a check or at the function entry.
+    if (entered && st.max_unchecked >= 0) {
+      long run = unchecked_run(bb, checks, memo);
+      st.max_unchecked = run < 0 ? -1 : std::max(st.max_unchecked, run);
+    }
+
+    // The state after an unchecked block is not known statically.
+    if (it == checks.end())
+      continue;
+
+    const cfcss_check &src = it->second;
+    size_t undetected = keys[0][src.G_out] + keys[1][src.G_out ^ src.D_out]
+                        + num_unchecked;
+    size_t num_succs = 0, num_edges = 0;
+    std::set<basic_block> succs;
+    for (edge succ : *bb->succs) {
+      if (succ->dest->index < NUM_FIXED_BLOCKS)
+        continue;
+      ++num_edges;
+      if (!succs.insert(succ->dest).second)
+        continue;
+      ++num_succs;
+      auto jt = checks.find(succ->dest);
+      if (jt == checks.end() || check_accepts(src, jt->second))
+        --undetected;
+    }
+
+    st.edges += num_edges;
+    if (undetected == 0)
+      st.protected_edges += num_edges;
+    st.illegal_jumps += num_blocks - num_succs;
+    st.detected_jumps += num_blocks - num_succs - undetected;
+  }
+}
+
+/**
+  * Appends @param stats to the statistics file, one line per function.
+  */
+static void write_stats(const std::map<std::string, cfcss_stats> &stats) {
+  if (stats_path.empty())
+    return;
+
+  FILE *file = fopen(stats_path.c_str(), "a");
+  if (!file) {
+    std::cerr << "Control flow checking note: cannot open " << stats_path
+              << std::endl;
+    return;
+  }
+  for (auto &pair : stats)
+    fprintf(file, "function %s copies %zu stubs %zu size %zu blocks %zu "
+            "ctrlsig_s %zu "
+            "ctrlsig_m %zu split_edges %zu pushsig %zu path_adds %zu "
+            "path_checks %zu hash_updates %zu hash_checks %zu "
+            "unified_blocks %zu call_sites %zu "
+            "private_call_sites %zu edges %zu protected_edges %zu "
+            "illegal_jumps %zu detected_jumps %zu return_edges %zu "
+            "protected_return_edges %zu aliased_blocks %zu "
+            "max_unchecked %ld\n",
+            pair.first.c_str(), pair.second.copies, pair.second.stubs,
+            pair.second.size,
+            pair.second.blocks, pair.second.ctrlsig_s, pair.second.ctrlsig_m,
+            pair.second.split_edges, pair.second.pushsig,
+            pair.second.path_adds, pair.second.path_checks,
+            pair.second.hash_updates, pair.second.hash_checks,
+            pair.second.unified_blocks,
+            pair.second.call_sites, pair.second.private_call_sites,
+            pair.second.edges, pair.second.protected_edges,
+            pair.second.illegal_jumps, pair.second.detected_jumps,
+            pair.second.return_edges, pair.second.protected_return_edges,
+            pair.second.aliased_blocks, pair.second.max_unchecked);
+  fclose(file);
+}
+
+/**
+  * Prints the protection metrics of the module.
+  */
+static void report_coverage(const std::map<std::string, cfcss_stats> &stats) {
+  cfcss_stats total;
+  auto pct = [](size_t part, size_t whole) {
+    return whole ? 100.0 * part / whole : 100.0;
+  };
+
+  total.copies = 0;
+  for (auto &pair : stats) {
+    total.blocks += pair.second.blocks;
+    total.edges += pair.second.edges;
+    total.protected_edges += pair.second.protected_edges;
+    total.illegal_jumps += pair.second.illegal_jumps;
+    total.detected_jumps += pair.second.detected_jumps;
+    total.return_edges += pair.second.return_edges;
+    total.protected_return_edges += pair.second.protected_return_edges;
+    total.aliased_blocks += pair.second.aliased_blocks;
+    if (total.max_unchecked >= 0)
+      total.max_unchecked = pair.second.max_unchecked < 0
+                            ? -1 : std::max(total.max_unchecked,
+                                            pair.second.max_unchecked);
+  }
+
+  fprintf(stderr, "Control flow checking note: %zu of %zu edges protected "
+          "(%.1f%%), %zu of %zu returns protected (%.1f%%)\n",
+          total.protected_edges, total.edges,
+          pct(total.protected_edges, total.edges),
+          total.protected_return_edges, total.return_edges,
+          pct(total.protected_return_edges, total.return_edges));
+  fprintf(stderr, "Control flow checking note: %zu of %zu illegal jumps "
+          "detected (%.1f%%), %zu of %zu blocks share a signature (%.1f%%)\n",
+          total.detected_jumps, total.illegal_jumps,
+          pct(total.detected_jumps, total.illegal_jumps),
+          total.aliased_blocks, total.blocks,
+          pct(total.aliased_blocks, total.blocks));
+  if (total.max_unchecked < 0)
+    fprintf(stderr, "Control flow checking note: unbounded unchecked "
+            "path\n");
+  else
+    fprintf(stderr, "Control flow checking note: at most %ld statements "
+            "between checks\n", total.max_unchecked);
+}
+
 unsigned int pass_cfcss::execute(function *fun) {
   // The signatures of basic blocks.
   std::map<basic_block, cfcss_sig_t> sig;
@@ -80,6 +1781,12 @@ unsigned int pass_cfcss::execute(function *fun) {
   // The clones of a function.
   std::map<std::pair<cgraph_node *, size_t>, cgraph_node *> clones;
 
+  // The function each copy was made from.
+  std::map<cgraph_node *, cgraph_node *> origin;
+
+  // Statistics, keyed by the assembler name of the original function.
+  std::map<std::string, cfcss_stats> stats;
+
   // A temporary accumulator.
   cfcss_sig_t acc = 0;
 
@@ -89,21 +1796,164 @@ unsigned int pass_cfcss::execute(function *fun) {
   // Adjusting signature values for fall-through multi-fan-in successors.
   std::map<basic_block, cfcss_sig_t> dmap_fall_thru;
 
+  // The checks actually inserted.
+  std::map<basic_block, cfcss_check> checks;
+
+  // The callee of the call each return target follows.
+  std::map<basic_block, cgraph_node *> return_targets;
+
+  // Loop headers whose check moves into the alignment padding, and the
+  // blocks entering the loops the moved checks go to.
+  std::map<basic_block, padded_header> padded_headers;
+  std::map<basic_block, basic_block> padding_checks;
+
+  // For callees that verify their returns: the return block whose signature
+  // every return leaves, the other return blocks, which move G to it before
+  // returning, and the continuations left unchecked.
+  std::map<cgraph_node *, basic_block> base_returns;
+  std::set<basic_block> return_checks;
+  std::set<basic_block> unchecked_conts;
+
+  // The blocks the spanning forests leave unchecked, and the blocks that
+  // take the signature of another block of their tree.
+  std::set<basic_block> tree_blocks;
+  std::map<basic_block, basic_block> tree_sigs;
+
+  // Functions checked by path ID, the entry block whose signature each of
+  // their blocks takes, and the blocks left unchecked.
+  std::set<cgraph_node *> path_checked;
+  std::map<basic_block, basic_block> path_sigs;
+  std::set<basic_block> path_blocks;
+
+  // Functions that only run before main(): those left uninstrumented, and
+  // those checked at their entry and the returns of their calls only. The
+  // blocks of both take the signature of the entry, like those of the
+  // functions checked by path ID, which entry_checked gathers with them.
+  std::set<cgraph_node *> exempt, entry_only;
+  std::set<cgraph_node *> entry_checked;
+
+  // Blocks that cross-jumping could fold, mapped to the base predecessor
+  // of their group, and to the block whose signature they take.
+  std::map<basic_block, basic_block> merge_bases;
+  std::map<basic_block, basic_block> merge_sigs;
+
+  // Functions with boundary signatures, those they call included, their
+  // entry blocks and the continuations of the calls of them.
+  std::set<cgraph_node *> boundary;
+  std::map<basic_block, cgraph_node *> boundary_entries;
+  std::map<basic_block, cgraph_node *> boundary_conts;
+
   // Call-graph code.
   cgraph_node *node;
 
   // Basic block.
   basic_block bb;
 
+  // The functions with bodies, in a stable order so that the copies a call
+  // site gets do not change when unrelated functions come and go.
+  std::vector<cgraph_node *> functions;
+  FOR_EACH_FUNCTION (node)
+    // We do not rule out the compiler-created clones.
+    if (node->has_gimple_body_p())
+      functions.push_back(node);
+  std::sort(functions.begin(), functions.end(), asm_name_less);
+
+  // Blocks that record themselves need neither copies nor checks.
+  if (record_size) {
+    record_blocks(functions);
+    return 0;
+  }
+
+  // Signal handlers start from G = 0 wherever they are entered; direct calls
+  // of them are treated like external calls.
+  std::set<cgraph_node *> handlers;
+  find_signal_handlers(functions, handlers);
+  find_startup_functions(functions, exempt, entry_only);
+
+  // Functions with boundary signatures are not bound to their callers.
+  // Those without callers in the module are entered like any other.
+  find_boundary_functions(functions, handlers, exempt, boundary);
+  if (dump_enabled_p()) {
+    for (cgraph_node *node : exempt)
+      dump_printf_loc(MSG_OPTIMIZED_LOCATIONS,
+                      dump_user_location_t::from_function_decl(node->decl),
+                      "%s only runs before main and is not instrumented\n",
+                      node->name());
+    for (cgraph_node *node : entry_only)
+      dump_printf_loc(MSG_OPTIMIZED_LOCATIONS,
+                      dump_user_location_t::from_function_decl(node->decl),
+                      "%s only runs before main; only its entry and the "
+                      "returns of its calls are checked\n", node->name());
+  }
+
+  if (!stats_path.empty())
+    for (cgraph_node *node : functions)
+      stats[node->asm_name()].size = estimate_size(node, false);
+
+  // Each function is its own origin until copies and stubs come in.
+  for (cgraph_node *node : functions)
+    origin[node] = node;
+
+  // Large functions are not copied for their call sites. Each call site
+  // class, i.e. each copy the function would get, calls a stub instead, and
+  // the stubs share the body. The origin of a stub is its body, whose
+  // options it takes. Recursive calls in the body keep calling the body.
+  std::set<cgraph_node *> stubbed;
+  for (size_t n = functions.size(), i = 0; i < n; ++i) {
+    cgraph_node *body = functions[i];
+    const cfcss_options &opts = options_for(body);
+    std::vector<cgraph_edge *> callers;
+    std::vector<cgraph_node *> stubs;
+
+    if (opts.stub_size == 0 || handlers.count(body) || boundary.count(body)
+        || exempt.count(body))
+      continue;
+    for (auto it = body->callers; it != nullptr; it = it->next_caller)
+      if (it->caller->has_gimple_body_p() && it->caller != body)
+        callers.push_back(it);
+    if (callers.size() < 2)
+      continue;
+    int size = estimate_size(body);
+    if ((size_t) size < opts.stub_size)
+      continue;
+
+    stubs.resize(opts.clone_budget ? std::min(opts.clone_budget,
+                                              callers.size())
+                                   : callers.size());
+    for (size_t j = 0; j < stubs.size(); ++j) {
+      stubs[j] = create_stub(body, j);
+      origin[stubs[j]] = body;
+      functions.push_back(stubs[j]);
+    }
+    for (size_t j = 0; j < callers.size(); ++j) {
+      cgraph_edge *edge = callers[j];
+      cgraph_node *stub = stubs[j % stubs.size()];
+      push_cfun(edge->caller->get_fun());
+      if (dump_enabled_p())
+        dump_printf_loc(MSG_OPTIMIZED_LOCATIONS, edge->call_stmt,
+                        "call site uses stub %s instead of a copy of %s "
+                        "(about %d bytes)\n", stub->name(), body->name(),
+                        size);
+      edge->redirect_callee(stub);
+      cgraph_edge::redirect_call_stmt_to_callee(edge);
+      pop_cfun();
+    }
+    stubbed.insert(body);
+    stats[body->asm_name()].stubs = stubs.size();
+  }
+  std::sort(functions.begin(), functions.end(), asm_name_less);
+
   // Look for the call sites. Those that invoke functions defined in this
   // module are used for interprocedural analysis, while those invoking
   // undefined functions are used to add pushsig/popsig instructions.
-  FOR_EACH_FUNCTION (node) {
-    // We do not rule out the compiler-created clones.
-    if (!node->has_gimple_body_p())
+  // Uninstrumented functions leave G alone, so calls of them are treated
+  // like external calls, and their own calls only reach their own kind.
+  for (cgraph_node *node : functions) {
+    if (exempt.count(node))
       continue;
     for (auto it = node->callees; it != nullptr; it = it->next_callee) {
-        if (it->callee->has_gimple_body_p()) {
+        if (it->callee->has_gimple_body_p() && !handlers.count(it->callee)
+            && !exempt.count(it->callee)) {
           
           // Splitting the basic block now can affect the iteration, so we
           // choose to move the splitting part outside.
@@ -116,20 +1966,60 @@ unsigned int pass_cfcss::execute(function *fun) {
           }
 
           dup_num[it] = num_clones[it->callee] - 1;
+
+          // Beyond the clone budget, call sites share the copies. A stub
+          // already stands for one copy of its body, and the stubs of a
+          // function share its only copy.
+          cgraph_node *body = origin[it->callee];
+          size_t budget = body != it->callee || stubbed.count(body)
+                          || boundary.count(body)
+                          ? 1 : options_for(body).clone_budget;
+          if (budget != 0)
+            dup_num[it] %= budget;
         } else {
           call_sites_undef.push_back(it);
         }
     }
   }
 
-  FOR_EACH_FUNCTION (node) {
-    if (!node->has_gimple_body_p())
+  for (auto &pair : num_clones) {
+    cgraph_node *body = origin[pair.first];
+    cfcss_stats &st = stats[body->asm_name()];
+
+    // The call sites of the stubs are those of the body; the body itself is
+    // only called by its stubs and itself.
+    if (body != pair.first) {
+      st.call_sites += pair.second;
+      st.private_call_sites += pair.second == 1;
+      pair.second = 1;
+      continue;
+    }
+    if (stubbed.count(body)) {
+      pair.second = 1;
       continue;
+    }
+    size_t budget = boundary.count(body) ? 1 : options_for(body).clone_budget;
+
+    st.call_sites = pair.second;
+    if (budget != 0 && pair.second > budget)
+      pair.second = budget;
+    st.copies = pair.second;
+    for (size_t i = 0; i < pair.second; ++i)
+      if (st.call_sites / pair.second + (i < st.call_sites % pair.second) == 1)
+        ++st.private_call_sites;
+  }
+
+  for (cgraph_node *node : functions) {
     clones[std::make_pair(node, 0)] = node;
     for (size_t i = 1; i < num_clones[node]; ++i) {
       cgraph_node *new_fun =
         node->create_version_clone_with_body(vNULL, nullptr, nullptr, nullptr,
-                                             nullptr, "");
+                                             nullptr, "cfcss");
+      // GCC numbers clones per function across all the passes that clone;
+      // name ours after the copy number instead.
+      tree name = clone_function_name(node->decl, "cfcss", i);
+      DECL_NAME(new_fun->decl) = name;
+      symtab->change_decl_assembler_name(new_fun->decl, name);
       auto it2 = node->callees;
       while (it2->next_callee) it2 = it2->next_callee;
       for (auto it1 = new_fun->callees;
@@ -139,25 +2029,80 @@ unsigned int pass_cfcss::execute(function *fun) {
           std::cerr << "it1->callee != it2->callee" << std::endl;
           return -1;
         }
-        if (it1->callee->has_gimple_body_p()) {
+        if (it1->callee->has_gimple_body_p() && !handlers.count(it1->callee)
+            && !exempt.count(it1->callee)) {
           call_sites.push_back(it1);
           dup_num[it1] = dup_num[it2];
+        } else {
+          call_sites_undef.push_back(it1);
         }
       }
       clones[std::make_pair(node, i)] = new_fun;
+      origin[new_fun] = node;
     }
   }
 
+  // The copies already reported, and their estimated sizes.
+  std::set<std::pair<cgraph_node *, size_t>> reported_clones;
+  std::map<cgraph_node *, int> clone_size;
+
   for (auto call_site : call_sites) {
     push_cfun(call_site->caller->get_fun());
+
+    // Report the call sites of the original functions only; those of the
+    // copies are duplicates.
+    size_t copy = dup_num[call_site];
+    if (copy != 0 && origin[call_site->caller] == call_site->caller
+        && dump_enabled_p()) {
+      cgraph_node *callee = call_site->callee;
+      if (reported_clones.insert(std::make_pair(callee, copy)).second) {
+        if (!clone_size.count(callee))
+          clone_size[callee] = estimate_size(callee);
+        dump_printf_loc(MSG_OPTIMIZED_LOCATIONS, call_site->call_stmt,
+                        "cloned callee %s for call site (about %d bytes)\n",
+                        callee->name(), clone_size[callee]);
+      } else {
+        dump_printf_loc(MSG_OPTIMIZED_LOCATIONS, call_site->call_stmt,
+                        "call site shares copy %u of callee %s\n",
+                        (unsigned) copy, callee->name());
+      }
+    }
+
     call_site->redirect_callee(clones[std::make_pair(call_site->callee,
-                                                     dup_num[call_site])]);
+                                                     copy)]);
     cgraph_edge::redirect_call_stmt_to_callee(call_site);
     split_block(call_site->call_stmt->bb, call_site->call_stmt);
+    return_targets[(*call_site->call_stmt->bb->succs)[0]->dest] =
+      call_site->callee;
 
     pop_cfun();
   }
 
+  // Path-ID checks change the CFG, so they go in before the blocks are
+  // bound to calls.
+  tree path_error = NULL_TREE, crc_table = NULL_TREE;
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY (node) {
+    const cfcss_options &opts = options_for(origin[node]);
+    if (!(opts.path_check || opts.hash_check)
+        || exempt.count(origin[node]) || entry_only.count(origin[node]))
+      continue;
+    if (!path_error)
+      path_error = build_fn_decl("cfcss_path_error",
+                                 build_function_type_list(void_type_node,
+                                                          NULL_TREE));
+    if (opts.hash_check && !crc_table && !crc_builtin())
+      crc_table = runtime_var("cfcss_crc_table",
+                              build_array_type_nelts(unsigned_type_node, 256));
+    if (add_path_checks(node, path_error, opts.hash_check, crc_table,
+                        origin[node] == node,
+                        stats[origin[node]->asm_name()]))
+      path_checked.insert(node);
+  }
+  entry_checked = path_checked;
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY (node)
+    if (exempt.count(origin[node]) || entry_only.count(origin[node]))
+      entry_checked.insert(node);
+
   // We have to use a new for-loop to find the predecessors of blocks after
   // calls and entry blocks, because basic blocks containing call statements
   // and the return statement might have been splitted. The basic blocks of
@@ -165,6 +2110,13 @@ unsigned int pass_cfcss::execute(function *fun) {
   // because the call sites in the same basic block in that version are in the
   // execution order, which is not true in the GCC version.
   for (auto call_site: call_sites) {
+    cgraph_node *callee = call_site->callee;
+    if (boundary.count(callee)) {
+      boundary_entries[ENTRY_BLOCK_PTR_FOR_FN(callee->get_fun())->next_bb] =
+        callee;
+      boundary_conts[(*call_site->call_stmt->bb->succs)[0]->dest] = callee;
+      continue;
+    }
     pred_set.insert(
       std::make_pair(ENTRY_BLOCK_PTR_FOR_FN(
         call_site->callee->get_fun())->next_bb, call_site->call_stmt->bb));
@@ -175,18 +2127,147 @@ unsigned int pass_cfcss::execute(function *fun) {
               std::make_pair((*call_site->call_stmt->bb->succs)[0]->dest, bb));
   }
 
+  // The blocks bound to calls and to padded headers keep their checks and
+  // signatures.
+  std::set<basic_block> fixed;
+  for (auto &pair : pred_set) {
+    fixed.insert(pair.first);
+    fixed.insert(pair.second);
+  }
+  for (auto &pair : boundary_entries)
+    fixed.insert(pair.first);
+  for (auto &pair : boundary_conts)
+    fixed.insert(pair.first);
+  for (auto call_site : call_sites)
+    if (boundary.count(call_site->callee))
+      fixed.insert(call_site->call_stmt->bb);
+  for (cgraph_node *node : boundary)
+    FOR_EACH_BB_FN (bb, node->get_fun())
+      if (return_stmt(bb))
+        fixed.insert(bb);
+
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY (node)
+    if (options_for(origin[node]).align_padding && !entry_checked.count(node))
+      find_padded_headers(node, fixed, padded_headers);
+  for (auto &pair : padded_headers) {
+    padding_checks[pair.second.preheader] = pair.first;
+    fixed.insert(pair.first);
+    fixed.insert(pair.second.preheader);
+    fixed.insert(pair.second.latches.begin(), pair.second.latches.end());
+  }
+
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY (node)
+    if (options_for(origin[node]).spanning_tree && !entry_checked.count(node))
+      find_unchecked_blocks(node, options_for(origin[node]).tree_max_stmts,
+                            fixed, tree_blocks, tree_sigs);
+
+  // A function checked by path ID or only at its entry keeps G at the
+  // signature of its entry block. Only the entry and the continuations of
+  // calls check it; the other blocks at most set D.
+  for (cgraph_node *node : entry_checked) {
+    basic_block entry = ENTRY_BLOCK_PTR_FOR_FN(node->get_fun())->next_bb;
+    FOR_EACH_BB_FN (bb, node->get_fun()) {
+      path_sigs[bb] = entry;
+      if (bb != entry && !pred_set.count(bb) && !boundary_conts.count(bb))
+        path_blocks.insert(bb);
+    }
+  }
+
+  FOR_EACH_FUNCTION_WITH_GIMPLE_BODY (node)
+    if (options_for(origin[node]).unify_tails && !entry_checked.count(node))
+      find_merge_groups(node, fixed, tree_blocks, merge_bases, merge_sigs,
+                        stats[origin[node]->asm_name()].unified_blocks,
+                        origin[node] == node);
+
   FOR_EACH_FUNCTION_WITH_GIMPLE_BODY (node) {
+    // The signatures inside a function with boundary signatures must not
+    // depend on the rest of the module either.
+    if (options_for(origin[node]).stable_signatures || boundary.count(node))
+      acc = signature_seed(node);
     FOR_EACH_BB_FN (bb, node->get_fun()) {
       // Naïve approach to assign signatures.
       sig[bb] = acc++;
     }
   }
 
+  // A latch leaves G as the check of its header would.
+  for (auto &pair : padded_headers)
+    for (basic_block latch : pair.second.latches)
+      sig[latch] = sig[pair.first];
+
+  // The blocks of a tree share a signature.
+  for (auto &pair : tree_sigs)
+    sig[pair.first] = sig[pair.second];
+  for (auto &pair : path_sigs)
+    sig[pair.first] = sig[pair.second];
+  for (auto &pair : merge_sigs)
+    sig[pair.first] = sig[pair.second];
+
+  // A continuation whose callee verifies its returns starts with G set to
+  // the signature of the base return block. Return blocks of the caller
+  // keep their check, so that the base return blocks keep their signatures.
+  for (auto &pair : return_targets) {
+    cgraph_node *callee = pair.second;
+    if (!options_for(origin[callee]).return_check || return_stmt(pair.first)
+        || path_sigs.count(pair.first) || boundary.count(callee))
+      continue;
+    if (!base_returns.count(callee)) {
+      basic_block base = nullptr;
+      FOR_EACH_BB_FN (bb, callee->get_fun())
+        if (return_stmt(bb)) {
+          if (base)
+            return_checks.insert(bb);
+          else
+            base = bb;
+        }
+      base_returns[callee] = base;
+    }
+    if (base_returns[callee]) {
+      sig[pair.first] = sig[base_returns[callee]];
+      unchecked_conts.insert(pair.first);
+    }
+  }
+
   FOR_EACH_FUNCTION_WITH_GIMPLE_BODY (node)
     FOR_EACH_BB_FN (bb, node->get_fun()) {
       size_t pred_set_len = pred_set.count(bb);
       auto pred_set_range = pred_set.equal_range(bb);
 
+      // The check of a padded header is computed where it is inserted, and
+      // unchecked continuations and tree blocks have the signature G
+      // already holds.
+      if (padded_headers.count(bb) || unchecked_conts.count(bb)
+          || tree_blocks.count(bb) || path_blocks.count(bb))
+        continue;
+
+      // The entry of a function with boundary signatures is entered with G
+      // at its entry signature and D = 0, whoever the caller is, and the
+      // continuation of a call of it with G at its return signature.
+      auto entry_of = boundary_entries.find(bb);
+      if (entry_of != boundary_entries.end()) {
+        cfcss_sig_t entry_sig = boundary_signature(entry_of->second, true);
+        diff[bb] = entry_sig ^ sig[bb];
+        for (edge pred_edge : *bb->preds)
+          if (pred_edge->src->index >= NUM_FIXED_BLOCKS)
+            dmap[pred_edge->src] = sig[pred_edge->src] ^ entry_sig;
+        continue;
+      }
+      auto cont_of = boundary_conts.find(bb);
+      if (cont_of != boundary_conts.end()) {
+        diff[bb] = boundary_signature(cont_of->second, false) ^ sig[bb];
+        continue;
+      }
+
+      // The blocks of a merge group take their predecessors together, as
+      // if they were merged already.
+      auto merged = merge_bases.find(bb);
+      if (merged != merge_bases.end()) {
+        diff[bb] = sig[merged->second] ^ sig[bb];
+        for (edge pred_edge : *bb->preds)
+          dmap[pred_edge->src] = sig[pred_edge->src] ^ sig[merged->second];
+        continue;
+      }
+
       if (pred_set_len == 1) {
         diff[bb] = sig[pred_set_range.first->second] ^ sig[bb];
       } else if (pred_set_len >= 2) {
@@ -223,7 +2304,9 @@ unsigned int pass_cfcss::execute(function *fun) {
       // A second adjusting signature has to be assigned when
       // (a) Both successors are multi-fan-in basic blocks, and
       // (b) The base predecessor of each successor is different.
-      if (bb->succs->length() == 2
+      if (bb->succs->length() == 2 && !path_sigs.count(bb)
+          && !merge_bases.count((*bb->succs)[0]->dest)
+          && !merge_bases.count((*bb->succs)[1]->dest)
           && (*bb->succs)[0]->dest->preds->length() > 1
           && (*bb->succs)[1]->dest->preds->length() > 1
           && (*(*bb->succs)[0]->dest->preds)[0]->src
@@ -241,6 +2324,16 @@ unsigned int pass_cfcss::execute(function *fun) {
     }
 
   for (cgraph_edge *edge : call_sites_undef) {
+    bool handler = handlers.count(edge->callee);
+
+    ++stats[origin[edge->caller]->asm_name()].pushsig;
+    if (origin[edge->caller] == edge->caller && dump_enabled_p())
+      dump_printf_loc(MSG_OPTIMIZED_LOCATIONS, edge->call_stmt,
+                      handler ? "call to signal handler %s wrapped in "
+                                "pushsig/popsig\n"
+                              : "external call to %s wrapped in "
+                                "pushsig/popsig\n",
+                      edge->callee->name());
     auto gsi = gsi_for_stmt(edge->call_stmt);
     auto stmt = gimple_build_asm_vec(
       ".insn r CUSTOM_1, 0, 0, x2, x0, x0",
@@ -250,6 +2343,18 @@ unsigned int pass_cfcss::execute(function *fun) {
     gsi_insert_before(&gsi, stmt, GSI_SAME_STMT);
     gimple_asm_set_volatile(stmt, true);
     gimple_set_modified(stmt, false);
+
+    // A signal handler expects G = 0 on entry. Any check of the block has
+    // set G to its signature by now, so a checked transition gets there.
+    if (handler) {
+      stmt = gimple_build_asm_vec(
+        inst_ctrlsig_s(sig[edge->call_stmt->bb], 0, 0),
+        nullptr, nullptr, nullptr, nullptr
+      );
+      gsi_insert_before(&gsi, stmt, GSI_SAME_STMT);
+      gimple_asm_set_volatile(stmt, true);
+      gimple_set_modified(stmt, false);
+    }
     stmt = gimple_build_asm_vec(
       ".insn r CUSTOM_1, 0, 0, x3, x0, x0",
       nullptr, nullptr, nullptr, nullptr
@@ -260,21 +2365,36 @@ unsigned int pass_cfcss::execute(function *fun) {
   }
 
   for (auto &pair : fall_thru_sigs) {
-    fprintf(stderr, "Control flow checking note: SPECIAL CASE\n");
+    if (dump_enabled_p())
+      dump_printf_loc(MSG_OPTIMIZED_LOCATIONS, pair.second,
+                      "split edge for fall-through adjustment\n");
     push_cfun(pair.first);
     auto pred_bb = pair.second->bb;
     auto orig_edge = (*pred_bb->succs)[1];
     auto succ_bb = orig_edge->dest;
     cfcss_sig_t dmap_val = sig[pred_bb] ^ sig[(*succ_bb->preds)[0]->src];
     bb = split_edge(orig_edge);
+    ++stats[origin[cgraph_node::get(pair.first->decl)]->asm_name()]
+      .split_edges;
     sig[bb] = sig[pred_bb];
     diff[bb] = 0;
     dmap[bb] = dmap_val;
     pop_cfun();
   }
 
+  // ... and leaves D as the check of its header would.
+  for (auto &pair : padded_headers)
+    for (basic_block latch : pair.second.latches)
+      if (dmap.count(pair.first))
+        dmap[latch] = dmap[pair.first];
+      else
+        dmap.erase(latch);
+
 
   FOR_EACH_FUNCTION_WITH_GIMPLE_BODY (node) {
+    if (exempt.count(origin[node]))
+      continue;
+    cfcss_stats &st = stats[origin[node]->asm_name()];
     push_cfun(node->get_fun());
     FOR_EACH_BB_FN (bb, cfun) {
       auto gsi = gsi_after_labels(bb);
@@ -284,18 +2404,264 @@ unsigned int pass_cfcss::execute(function *fun) {
       cfcss_sig_t cur_diff = diff[bb];
       cfcss_sig_t cur_adj = dmap.find(bb) != dmap.end() ? dmap[bb] : 0;
 
-      if (bb->preds->length() >= 2 || pred_set.count(bb) >= 2)
+      ++st.blocks;
+      if (padded_headers.count(bb)) {
+        if (dump_enabled_p() && origin[node] == node)
+          dump_printf_loc(MSG_OPTIMIZED_LOCATIONS, block_location(bb, cfun),
+                          "moved check of loop header into the alignment "
+                          "padding in front of it\n");
+        continue;
+      }
+      if (tree_blocks.count(bb)) {
+        if (dump_enabled_p() && origin[node] == node)
+          dump_printf_loc(MSG_OPTIMIZED_LOCATIONS, block_location(bb, cfun),
+                          "no check on the spanning tree of the CFG\n");
+        continue;
+      }
+
+      // The path ID is checked instead, or nothing; G stays as it is.
+      if (path_blocks.count(bb)) {
+        if (dmap.count(bb)) {
+          stmt = gimple_build_asm_vec(inst_ctrlsig_s(0, cur_sig, cur_adj),
+                                      nullptr, nullptr, nullptr, nullptr);
+          gimple_asm_set_volatile(stmt, true);
+          gsi_insert_before(&gsi, stmt, GSI_SAME_STMT);
+          ++st.ctrlsig_s;
+          checks[bb] = { false, 0, cur_sig, cur_adj, cur_sig, cur_adj };
+        }
+        continue;
+      }
+
+      // The callee has verified the return, so only a D the successors
+      // need is left to set.
+      if (unchecked_conts.count(bb)) {
+        auto target = return_targets.find(bb);
+        if (dump_enabled_p() && origin[node] == node)
+          dump_printf_loc(MSG_OPTIMIZED_LOCATIONS, block_location(bb, cfun),
+                          dmap.count(bb)
+                          ? "return from %s verified by the callee; the "
+                            "continuation only sets D\n"
+                          : "return from %s verified by the callee; the "
+                            "continuation is left unchecked\n",
+                          target->second->name());
+        if (dmap.count(bb)) {
+          stmt = gimple_build_asm_vec(inst_ctrlsig_s(0, cur_sig, cur_adj),
+                                      nullptr, nullptr, nullptr, nullptr);
+          gimple_asm_set_volatile(stmt, true);
+          gsi_insert_before(&gsi, stmt, GSI_SAME_STMT);
+          ++st.ctrlsig_s;
+          checks[bb] = { false, 0, cur_sig, cur_adj, cur_sig, cur_adj };
+        }
+        continue;
+      }
+      if (dump_enabled_p() && origin[node] == node) {
+        auto loc = block_location(bb, cfun);
+        auto target = return_targets.find(bb);
+        if (bb == ENTRY_BLOCK_PTR_FOR_FN(cfun)->next_bb
+            && pred_set.count(bb) >= 2)
+          dump_printf_loc(MSG_MISSED_OPTIMIZATION, loc,
+                          "could not elide check because %s is entered from "
+                          "%u call sites\n", node->name(),
+                          (unsigned) pred_set.count(bb));
+        else if (target != return_targets.end())
+          dump_printf_loc(MSG_MISSED_OPTIMIZATION, loc,
+                          "could not elide check because the block is the "
+                          "return target of a call to %s\n",
+                          target->second->name());
+        else if (bb->preds->length() >= 2)
+          dump_printf_loc(MSG_MISSED_OPTIMIZATION, loc,
+                          "could not elide check because %u edges merge "
+                          "here\n", bb->preds->length());
+      }
+      if (bb->preds->length() >= 2 || pred_set.count(bb) >= 2
+          || merge_bases.count(bb)) {
         stmt = gimple_build_asm_vec(inst_ctrlsig_m(cur_diff, cur_sig, cur_adj),
                                     nullptr, nullptr, nullptr, nullptr);
-      else
+        ++st.ctrlsig_m;
+        checks[bb] = { true, cur_diff, cur_sig, cur_adj, cur_sig, cur_adj };
+      } else {
         stmt = gimple_build_asm_vec(inst_ctrlsig_s(cur_diff, cur_sig, cur_adj),
                                     nullptr, nullptr, nullptr, nullptr);
+        ++st.ctrlsig_s;
+        checks[bb] = { false, cur_diff, cur_sig, cur_adj, cur_sig, cur_adj };
+      }
+      gimple_asm_set_volatile(stmt, true);
+      gsi_insert_before(&gsi, stmt, GSI_SAME_STMT);
+
+      // The moved check of a padded header. Only this block enters the
+      // loop, so a ctrlsig_s suffices.
+      auto padded = padding_checks.find(bb);
+      if (padded != padding_checks.end()) {
+        basic_block header = padded->second;
+        cfcss_sig_t hdr_adj = dmap.count(header) ? dmap[header] : 0;
+        stmt = gimple_build_asm_vec(inst_ctrlsig_s(cur_sig ^ sig[header],
+                                                   sig[header], hdr_adj),
+                                    nullptr, nullptr, nullptr, nullptr);
+        gimple_asm_set_volatile(stmt, true);
+        gsi = gsi_last_bb(bb);
+        gsi_insert_after(&gsi, stmt, GSI_NEW_STMT);
+        ++st.ctrlsig_s;
+        checks[bb].G_out = sig[header];
+        checks[bb].D_out = hdr_adj;
+      }
+
+      // Every return leaves the signature of the base return block.
+      if (return_checks.count(bb)) {
+        cfcss_sig_t ret_sig = sig[base_returns[node]];
+        stmt = gimple_build_asm_vec(inst_ctrlsig_s(cur_sig ^ ret_sig,
+                                                   ret_sig, 0),
+                                    nullptr, nullptr, nullptr, nullptr);
+        gimple_asm_set_volatile(stmt, true);
+        gsi = gsi_for_stmt(return_stmt(bb));
+        gsi_insert_before(&gsi, stmt, GSI_SAME_STMT);
+        ++st.ctrlsig_s;
+        checks[bb].G_out = ret_sig;
+        checks[bb].D_out = 0;
+      }
+    }
+    pop_cfun();
+  }
+
+  // G goes to the entry signature right before a call of a function with
+  // boundary signatures, and to the return signature right before each of
+  // its returns.
+  for (auto call_site : call_sites) {
+    if (!boundary.count(call_site->callee))
+      continue;
+    bb = call_site->call_stmt->bb;
+    cfcss_sig_t entry_sig = boundary_signature(call_site->callee, true);
+    auto gsi = gsi_for_stmt(call_site->call_stmt);
+    gasm *stmt = gimple_build_asm_vec(inst_ctrlsig_s(sig[bb] ^ entry_sig,
+                                                     entry_sig, 0),
+                                      nullptr, nullptr, nullptr, nullptr);
+    gimple_asm_set_volatile(stmt, true);
+    gsi_insert_before(&gsi, stmt, GSI_SAME_STMT);
+    ++stats[origin[call_site->caller]->asm_name()].ctrlsig_s;
+    if (checks.count(bb)) {
+      checks[bb].G_out = entry_sig;
+      checks[bb].D_out = 0;
+    }
+  }
+  for (cgraph_node *node : boundary) {
+    cfcss_sig_t entry_sig = boundary_signature(node, true);
+    cfcss_sig_t ret_sig = boundary_signature(node, false);
+    FOR_EACH_BB_FN (bb, node->get_fun()) {
+      gimple *ret = return_stmt(bb);
+      if (!ret)
+        continue;
+      auto gsi = gsi_for_stmt(ret);
+      gasm *stmt = gimple_build_asm_vec(inst_ctrlsig_s(sig[bb] ^ ret_sig,
+                                                       ret_sig, 0),
+                                        nullptr, nullptr, nullptr, nullptr);
+      gimple_asm_set_volatile(stmt, true);
+      gsi_insert_before(&gsi, stmt, GSI_SAME_STMT);
+      ++stats[node->asm_name()].ctrlsig_s;
+      if (checks.count(bb)) {
+        checks[bb].G_out = ret_sig;
+        checks[bb].D_out = 0;
+      }
+    }
+
+    // Publish the signatures as absolute symbols, so that a patch can be
+    // checked against the image it goes into.
+    const char *name = node->asm_name();
+    std::ostringstream text;
+    if (*name == '*')
+      ++name;
+    text << ".set cfcss.entry." << name << ", " << (unsigned) entry_sig
+         << "\n.set cfcss.return." << name << ", " << (unsigned) ret_sig;
+    symtab->finalize_toplevel_asm(build_string(text.str().size(),
+                                               text.str().c_str()));
+    if (dump_enabled_p())
+      dump_printf_loc(MSG_NOTE,
+                      dump_user_location_t::from_function_decl(node->decl),
+                      "%s has boundary signatures: entry %u, return %u\n",
+                      node->name(), (unsigned) entry_sig, (unsigned) ret_sig);
+  }
+
+  // The pass cannot set G outright, so a static constructor with a startup
+  // level saves G and D on entry and restores them on return. Uninstrumented
+  // functions leave them alone, so main() is entered with G as at boot,
+  // whatever the constructors did.
+  for (cgraph_node *node : functions) {
+    if (!DECL_STATIC_CONSTRUCTOR(node->decl) || exempt.count(node)
+        || options_for(node).startup_level == 0 || node->callers)
+      continue;
+    push_cfun(node->get_fun());
+    auto gsi = gsi_after_labels(ENTRY_BLOCK_PTR_FOR_FN(cfun)->next_bb);
+    gasm *stmt = gimple_build_asm_vec(".insn r CUSTOM_1, 0, 0, x2, x0, x0",
+                                      nullptr, nullptr, nullptr, nullptr);
+    gimple_asm_set_volatile(stmt, true);
+    gsi_insert_before(&gsi, stmt, GSI_SAME_STMT);
+    FOR_EACH_BB_FN (bb, cfun) {
+      gimple *ret = return_stmt(bb);
+      if (!ret)
+        continue;
+      gsi = gsi_for_stmt(ret);
+      stmt = gimple_build_asm_vec(".insn r CUSTOM_1, 0, 0, x3, x0, x0",
+                                  nullptr, nullptr, nullptr, nullptr);
       gimple_asm_set_volatile(stmt, true);
       gsi_insert_before(&gsi, stmt, GSI_SAME_STMT);
     }
+    ++stats[node->asm_name()].pushsig;
     pop_cfun();
   }
 
+  if (!stats_path.empty() || report) {
+    size_t sig_count[256] = {};
+    for (auto &pair : checks)
+      ++sig_count[pair.second.S];
+    FOR_EACH_FUNCTION_WITH_GIMPLE_BODY (node) {
+      cfcss_stats copy_st;
+      cfcss_stats &st = stats[origin[node]->asm_name()];
+      measure_coverage(node->get_fun(), checks, sig_count, copy_st);
+      st.edges += copy_st.edges;
+      st.protected_edges += copy_st.protected_edges;
+      st.illegal_jumps += copy_st.illegal_jumps;
+      st.detected_jumps += copy_st.detected_jumps;
+      st.aliased_blocks += copy_st.aliased_blocks;
+      if (st.max_unchecked >= 0)
+        st.max_unchecked = copy_st.max_unchecked < 0
+                           ? -1 : std::max(st.max_unchecked,
+                                           copy_st.max_unchecked);
+    }
+
+    // A corrupted return may reach the continuation of any internal call.
+    size_t cont_keys[2][256] = {};
+    size_t num_unchecked_conts = 0;
+    for (auto call_site : call_sites) {
+      auto it = checks.find((*call_site->call_stmt->bb->succs)[0]->dest);
+      if (it == checks.end())
+        ++num_unchecked_conts;
+      else
+        ++cont_keys[it->second.multi][it->second.S ^ it->second.d];
+    }
+    for (auto call_site : call_sites) {
+      cfcss_stats &st = stats[origin[call_site->callee]->asm_name()];
+      auto cont = checks.find((*call_site->call_stmt->bb->succs)[0]->dest);
+      FOR_EACH_BB_FN (bb, call_site->callee->get_fun()) {
+        auto gsi = gsi_last_bb(bb);
+        auto it = checks.find(bb);
+        if (gsi_end_p(gsi) || gimple_code(gsi_stmt(gsi)) != GIMPLE_RETURN
+            || it == checks.end())
+          continue;
+        size_t undetected = cont_keys[0][it->second.G_out]
+                            + cont_keys[1][it->second.G_out
+                                           ^ it->second.D_out]
+                            + num_unchecked_conts;
+        if (cont == checks.end() || check_accepts(it->second, cont->second))
+          --undetected;
+        ++st.return_edges;
+        if (undetected == 0)
+          ++st.protected_return_edges;
+      }
+    }
+  }
+
+  write_stats(stats);
+  if (report)
+    report_coverage(stats);
+
   return 0;
 }
 
@@ -315,6 +2681,35 @@ int plugin_init(plugin_name_args *plugin_info, plugin_gcc_version *version) {
   if (!plugin_default_version_check(version, &gcc_version))
     return 1;
 
+  const char *options_file = nullptr;
+  for (int i = 0; i < plugin_info->argc; ++i) {
+    const char *key = plugin_info->argv[i].key;
+    const char *value = plugin_info->argv[i].value;
+    if (strcmp(key, "options-file") == 0 && value) {
+      options_file = value;
+    } else if (strcmp(key, "stats") == 0 && value) {
+      stats_path = value;
+    } else if (strcmp(key, "report") == 0 && !value) {
+      report = true;
+    } else if (strcmp(key, "record") == 0 && value) {
+      record_size = strtoul(value, nullptr, 10);
+      if (record_size == 0 || (record_size & (record_size - 1)) != 0) {
+        std::cerr << "Control flow checking error: the ring size must be "
+                     "a power of two" << std::endl;
+        return 1;
+      }
+    } else if (strcmp(key, "sigmap") == 0 && value) {
+      sigmap_path = value;
+    } else if (!set_option(global_opts, key, value)) {
+      std::cerr << "Control flow checking error: invalid option " << key
+                << std::endl;
+      return 1;
+    }
+  }
+  // The file is read last so that its entries start from the module options.
+  if (options_file && !read_options_file(options_file))
+    return 1;
+
   register_callback(
     plugin_info->base_name,
     PLUGIN_PASS_MANAGER_SETUP,
@@ -0,0 +1,489 @@
+///
+/// Trap-and-emulate runtime for the control-flow checking instructions.
+///
+/// Hardware-mode binaries contain ctrlsig_s/m (CUSTOM_0) and pushsig/popsig
+/// (CUSTOM_1), which a stock core or qemu-riscv64 in user mode rejects with
+/// SIGILL. Linking this file into such a binary installs a SIGILL handler that
+/// carries out the instructions on a per-thread copy of G, D and the signature
+/// stack, so the very binaries we ship can run on any Linux box.
+///
+/// Signal handlers interrupt instrumented code at any point, so the runtime
+/// also wraps sigaction() and signal(): each handler runs with G = D = 0, which
+/// is what the plugin expects at the entry of a handler, and the interrupted
+/// code gets its state back when the handler returns.
+///
+/// Functions checked by path ID call cfcss_path_error() when a check fails.
+/// Those that also hash their paths look up cfcss_crc_table when the
+/// compiler has no CRC builtin.
+///
+/// It also defines the per-thread ring of the flight-recorder mode
+/// (-fplugin-arg-plugin-record=N, with N equal to CFCSS_RING_SIZE) and
+/// cfcss_ring_dump(), whose output the flight decoder reads.
+///
+/// Build (this file must NOT be compiled with the plugin):
+///   riscv64-linux-gnu-g++ -O2 -fno-exceptions -fno-rtti -c runtime.cpp
+/// and link with -Wl,--wrap=sigaction,--wrap=signal to cover signal handlers.
+/// tests/sigill.sh checks that stray illegal instructions still kill the
+/// program.
+///
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ucontext.h>
+#include <unistd.h>
+
+#define OPCODE_CUSTOM_0 0x0b
+#define OPCODE_CUSTOM_1 0x2b
+
+// Depth of the emulated signature stack.
+#define SIG_STACK_DEPTH 256
+
+// Number of entries of the direct-mapped decoded-instruction cache.
+#define DECODE_CACHE_SIZE 1024
+
+// Entries of the flight-recorder ring; a power of two.
+#ifndef CFCSS_RING_SIZE
+#define CFCSS_RING_SIZE 256
+#endif
+static_assert(CFCSS_RING_SIZE >= 16
+              && (CFCSS_RING_SIZE & (CFCSS_RING_SIZE - 1)) == 0,
+              "CFCSS_RING_SIZE must be a power of two of at least 16");
+
+#define RT_TLS __attribute__((tls_model("initial-exec"))) thread_local
+
+enum rt_op : uint8_t {
+  OP_NONE,
+  OP_CTRLSIG_S,
+  OP_CTRLSIG_M,
+  OP_PUSHSIG,
+  OP_POPSIG
+};
+
+// An instruction decoded once and then reused by every later trap at the
+// same PC.
+struct rt_decoded {
+  uintptr_t pc;
+  rt_op op;
+  uint8_t d;
+  uint8_t S;
+  uint8_t D;
+};
+
+// The architectural state the instructions operate on.
+struct rt_state {
+  uint8_t G;
+  uint8_t D;
+  size_t sp;
+  uint8_t stack[SIG_STACK_DEPTH][2];
+};
+
+// The signatures of the last blocks executed in flight-recorder mode, and
+// how many blocks were recorded; the next one goes to the entry the count
+// modulo the size of the ring selects.
+extern "C" RT_TLS uint8_t cfcss_ring[CFCSS_RING_SIZE];
+extern "C" RT_TLS unsigned cfcss_ring_count;
+RT_TLS uint8_t cfcss_ring[CFCSS_RING_SIZE];
+RT_TLS unsigned cfcss_ring_count;
+
+// The bit-forward CRC-32C of each byte, which path hashes step with. The
+// plugin sees it as an array of 256 words.
+struct rt_crc_table {
+  uint32_t entries[256];
+
+  constexpr rt_crc_table() : entries() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i << 24;
+      for (int j = 0; j < 8; ++j)
+        crc = crc & 0x80000000u ? crc << 1 ^ 0x1edc6f41u : crc << 1;
+      entries[i] = crc;
+    }
+  }
+};
+extern "C" const rt_crc_table cfcss_crc_table;
+const rt_crc_table cfcss_crc_table;
+
+static RT_TLS rt_state state;
+static RT_TLS rt_decoded cache[DECODE_CACHE_SIZE];
+
+static struct sigaction prev_action;
+
+// The handlers the program installed, per signal. The runtime installs its
+// trampolines in their place.
+static void *user_handlers[NSIG];
+
+// The state of the interrupted code while a signal handler runs.
+struct rt_saved {
+  uint8_t G;
+  uint8_t D;
+  size_t sp;
+};
+
+// Resolved to the real sigaction() by --wrap=sigaction, null without it.
+extern "C" int __real_sigaction(int signo, const struct sigaction *act,
+                                struct sigaction *oldact)
+  __attribute__((weak));
+
+/**
+  * Writes a fixed message with async-signal-safe calls only.
+  */
+static void rt_write(const char *msg)
+{
+  ssize_t ret = write(STDERR_FILENO, msg, strlen(msg));
+  (void)ret;
+}
+
+/**
+  * Writes @param val in hexadecimal with async-signal-safe calls only.
+  */
+static void rt_write_hex(uintptr_t val)
+{
+  char buffer[2 + 2 * sizeof(val) + 1];
+  int pos = sizeof(buffer) - 1;
+  buffer[pos] = '\0';
+  do {
+    buffer[--pos] = "0123456789abcdef"[val & 0xf];
+    val >>= 4;
+  } while (val != 0);
+  buffer[--pos] = 'x';
+  buffer[--pos] = '0';
+  rt_write(buffer + pos);
+}
+
+/**
+  * Writes the flight-recorder ring of the calling thread to @param fd with
+  * async-signal-safe calls only, e.g. from a crash handler: a header line
+  * "cfcss ring SIZE POS COUNT" and the entries as hexadecimal bytes in ring
+  * order. COUNT is the number of entries written, at most SIZE; the oldest
+  * entry is the one at POS once the ring is full, and at 0 before. The count
+  * wraps after 2^32 blocks, which for the next SIZE blocks makes the ring
+  * look partly unwritten.
+  */
+extern "C" void cfcss_ring_dump(int fd)
+{
+  char buffer[3 * 16 + 1];
+  char header[64] = "cfcss ring ";
+  size_t len = strlen(header);
+  unsigned count = cfcss_ring_count;
+  unsigned vals[3] = { CFCSS_RING_SIZE, count % CFCSS_RING_SIZE,
+                       count < CFCSS_RING_SIZE ? count : CFCSS_RING_SIZE };
+
+  for (unsigned val : vals) {
+    char digits[16];
+    int pos = 0;
+    do {
+      digits[pos++] = '0' + val % 10;
+      val /= 10;
+    } while (val != 0);
+    while (pos > 0)
+      header[len++] = digits[--pos];
+    header[len++] = ' ';
+  }
+  header[len - 1] = '\n';
+  ssize_t ret = write(fd, header, len);
+
+  for (unsigned i = 0; i < CFCSS_RING_SIZE; i += 16) {
+    for (unsigned j = 0; j < 16; ++j) {
+      uint8_t val = cfcss_ring[i + j];
+      buffer[3 * j] = "0123456789abcdef"[val >> 4];
+      buffer[3 * j + 1] = "0123456789abcdef"[val & 0xf];
+      buffer[3 * j + 2] = j == 15 ? '\n' : ' ';
+    }
+    ret = write(fd, buffer, 3 * 16);
+  }
+  (void)ret;
+}
+
+/**
+  * Reports a control-flow error detected at @param pc. Programs may override
+  * it, e.g. to log the error and restart the task; the default aborts.
+  */
+extern "C" __attribute__((weak)) void cfcss_rt_error(uintptr_t pc,
+                                                      const char *what)
+{
+  rt_write("Control flow checking error: ");
+  rt_write(what);
+  rt_write(" at pc ");
+  rt_write_hex(pc);
+  rt_write("\n");
+  abort();
+}
+
+/**
+  * Called by the path-ID checks of -fplugin-arg-plugin-path-check when a
+  * function reaches a back edge or a return with an ID none of its paths
+  * has, and by those of -fplugin-arg-plugin-hash-check when the path hash is
+  * not the one of the path the ID names.
+  */
+extern "C" void cfcss_path_error()
+{
+  cfcss_rt_error(reinterpret_cast<uintptr_t>(__builtin_return_address(0)),
+                 "illegal path");
+}
+
+/**
+  * Decodes the instruction at @param pc. The encoding is the one produced by
+  * _inst_ctrlsig in func.cpp and by the pushsig/popsig instructions of the
+  * plugin.
+  */
+static rt_decoded rt_decode(uintptr_t pc)
+{
+  rt_decoded ins = { pc, OP_NONE, 0, 0, 0 };
+  uint32_t insn;
+
+  memcpy(&insn, reinterpret_cast<const void *>(pc), sizeof(insn));
+  switch (insn & 0x7f) {
+  case OPCODE_CUSTOM_0:
+    ins.op = (insn >> 7) & 1 ? OP_CTRLSIG_M : OP_CTRLSIG_S;
+    ins.D = (insn >> 8) & 0xff;
+    ins.S = (insn >> 16) & 0xff;
+    ins.d = (insn >> 24) & 0xff;
+    break;
+  case OPCODE_CUSTOM_1:
+    // funct3, funct7, rs1 and rs2 are all zero; rd selects the operation.
+    if ((insn & 0xfffff000) != 0)
+      break;
+    if (((insn >> 7) & 0x1f) == 2)
+      ins.op = OP_PUSHSIG;
+    else if (((insn >> 7) & 0x1f) == 3)
+      ins.op = OP_POPSIG;
+    break;
+  }
+  return ins;
+}
+
+/**
+  * Looks up @param pc in the decoded-instruction cache, decoding it on a miss.
+  */
+static const rt_decoded &rt_lookup(uintptr_t pc)
+{
+  // Instructions are 4-byte aligned in practice, so drop the low bits.
+  rt_decoded &entry = cache[(pc >> 2) & (DECODE_CACHE_SIZE - 1)];
+  if (entry.pc != pc || entry.op == OP_NONE)
+    entry = rt_decode(pc);
+  return entry;
+}
+
+/**
+  * Starts a signal handler from G = D = 0, like any function entered without
+  * a known caller. The handler's pushsig/popsig pairs stay above the saved
+  * stack pointer, so the interrupted code's stack is left alone.
+  * @return the state of the interrupted code
+  */
+static inline rt_saved rt_enter_handler()
+{
+  rt_saved saved = { state.G, state.D, state.sp };
+  state.G = 0;
+  state.D = 0;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  return saved;
+}
+
+/**
+  * Gives the interrupted code its state @param saved back.
+  */
+static inline void rt_leave_handler(const rt_saved &saved)
+{
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  state.G = saved.G;
+  state.D = saved.D;
+  state.sp = saved.sp;
+}
+
+static void rt_handler(int signo)
+{
+  auto handler = reinterpret_cast<void (*)(int)>(
+    __atomic_load_n(&user_handlers[signo], __ATOMIC_RELAXED));
+  rt_saved saved = rt_enter_handler();
+  handler(signo);
+  rt_leave_handler(saved);
+}
+
+static void rt_handler_info(int signo, siginfo_t *info, void *ctx)
+{
+  auto handler = reinterpret_cast<void (*)(int, siginfo_t *, void *)>(
+    __atomic_load_n(&user_handlers[signo], __ATOMIC_RELAXED));
+  rt_saved saved = rt_enter_handler();
+  handler(signo, info, ctx);
+  rt_leave_handler(saved);
+}
+
+/**
+  * Calls the real sigaction(), bypassing the wrapper when it is linked in.
+  */
+static int rt_sigaction(int signo, const struct sigaction *act,
+                        struct sigaction *oldact)
+{
+  if (__real_sigaction)
+    return __real_sigaction(signo, act, oldact);
+  return sigaction(signo, act, oldact);
+}
+
+/**
+  * Hands a SIGILL that does not come from our instructions to whatever
+  * handled it before the runtime was installed, or to the handler the
+  * program installed afterwards.
+  */
+static void rt_forward(int signo, siginfo_t *info, void *ctx)
+{
+  if (prev_action.sa_flags & SA_SIGINFO) {
+    if (prev_action.sa_sigaction) {
+      rt_saved saved = rt_enter_handler();
+      prev_action.sa_sigaction(signo, info, ctx);
+      rt_leave_handler(saved);
+      return;
+    }
+  } else if (prev_action.sa_handler != SIG_DFL
+             && prev_action.sa_handler != SIG_IGN) {
+    rt_saved saved = rt_enter_handler();
+    prev_action.sa_handler(signo);
+    rt_leave_handler(saved);
+    return;
+  }
+
+  // Re-executing the faulting instruction with the default action raises the
+  // original SIGILL again and terminates the process as usual. signal() would
+  // go to the wrapper under --wrap=signal, which only records the action for
+  // SIGILL, so the real sigaction() resets it.
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = SIG_DFL;
+  sigemptyset(&action.sa_mask);
+  rt_sigaction(signo, &action, nullptr);
+}
+
+static void rt_sigill(int signo, siginfo_t *info, void *ctx)
+{
+  ucontext_t *uc = static_cast<ucontext_t *>(ctx);
+  uintptr_t pc = uc->uc_mcontext.__gregs[REG_PC];
+  const rt_decoded &ins = rt_lookup(pc);
+
+  switch (ins.op) {
+  case OP_NONE:
+    rt_forward(signo, info, ctx);
+    return;
+  case OP_CTRLSIG_S:
+  case OP_CTRLSIG_M:
+    state.G ^= ins.d;
+    if (ins.op == OP_CTRLSIG_M)
+      state.G ^= state.D;
+    if (state.G != ins.S)
+      cfcss_rt_error(pc, "signature mismatch");
+    state.D = ins.D;
+    break;
+  case OP_PUSHSIG:
+    if (state.sp == SIG_STACK_DEPTH)
+      cfcss_rt_error(pc, "signature stack overflow");
+    state.stack[state.sp][0] = state.G;
+    state.stack[state.sp][1] = state.D;
+    ++state.sp;
+    break;
+  case OP_POPSIG:
+    if (state.sp == 0)
+      cfcss_rt_error(pc, "signature stack underflow");
+    --state.sp;
+    state.G = state.stack[state.sp][0];
+    state.D = state.stack[state.sp][1];
+    break;
+  }
+
+  // All the emulated instructions are 32 bits wide.
+  uc->uc_mcontext.__gregs[REG_PC] = pc + 4;
+}
+
+/**
+  * Installs the SIGILL handler. It runs from .preinit_array, i.e. before any
+  * instrumented static constructor.
+  */
+static void rt_install()
+{
+  struct sigaction action;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = rt_sigill;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  // A handler must not see G and D halfway through an instruction.
+  sigfillset(&action.sa_mask);
+  if (rt_sigaction(SIGILL, &action, &prev_action) != 0) {
+    rt_write("Control flow checking error: cannot install SIGILL handler\n");
+    abort();
+  }
+}
+
+__attribute__((section(".preinit_array"), used))
+static void (*rt_preinit)() = rt_install;
+
+/**
+  * Wrapper of sigaction() (-Wl,--wrap=sigaction) that puts a trampoline
+  * around the handler. SIGILL stays with the runtime; the program's handler
+  * only gets the SIGILLs that are not ours.
+  */
+extern "C" int __wrap_sigaction(int signo, const struct sigaction *act,
+                                struct sigaction *oldact)
+{
+  struct sigaction wrapped;
+  void *prev;
+  int ret;
+
+  if (signo <= 0 || signo >= NSIG)
+    return rt_sigaction(signo, act, oldact);
+  if (signo == SIGILL) {
+    if (oldact)
+      *oldact = prev_action;
+    if (act)
+      prev_action = *act;
+    return 0;
+  }
+
+  prev = __atomic_load_n(&user_handlers[signo], __ATOMIC_RELAXED);
+  if (act && ((act->sa_flags & SA_SIGINFO)
+              || (act->sa_handler != SIG_DFL && act->sa_handler != SIG_IGN))) {
+    wrapped = *act;
+    if (act->sa_flags & SA_SIGINFO) {
+      __atomic_store_n(&user_handlers[signo],
+                       reinterpret_cast<void *>(act->sa_sigaction),
+                       __ATOMIC_RELAXED);
+      wrapped.sa_sigaction = rt_handler_info;
+    } else {
+      __atomic_store_n(&user_handlers[signo],
+                       reinterpret_cast<void *>(act->sa_handler),
+                       __ATOMIC_RELAXED);
+      wrapped.sa_handler = rt_handler;
+    }
+    act = &wrapped;
+  }
+
+  ret = rt_sigaction(signo, act, oldact);
+  if (ret != 0) {
+    __atomic_store_n(&user_handlers[signo], prev, __ATOMIC_RELAXED);
+    return ret;
+  }
+
+  // Report the program's own handler rather than the trampoline.
+  if (oldact) {
+    if ((oldact->sa_flags & SA_SIGINFO)
+        && oldact->sa_sigaction == rt_handler_info)
+      oldact->sa_sigaction =
+        reinterpret_cast<void (*)(int, siginfo_t *, void *)>(prev);
+    else if (!(oldact->sa_flags & SA_SIGINFO)
+             && oldact->sa_handler == rt_handler)
+      oldact->sa_handler = reinterpret_cast<void (*)(int)>(prev);
+  }
+  return 0;
+}
+
+/**
+  * Wrapper of signal() (-Wl,--wrap=signal) with the BSD semantics of glibc.
+  */
+extern "C" sighandler_t __wrap_signal(int signo, sighandler_t handler)
+{
+  struct sigaction act, oldact;
+
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = handler;
+  act.sa_flags = SA_RESTART;
+  sigemptyset(&act.sa_mask);
+  if (__wrap_sigaction(signo, &act, &oldact) != 0)
+    return SIG_ERR;
+  return oldact.sa_handler;
+}
@@ -0,0 +1,578 @@
+///
+/// Cycle-approximate model of an in-order RISC-V pipeline with the
+/// control-flow checking hardware.
+///
+/// The model replays an instruction trace of an instrumented benchmark and
+/// accounts for the I-cache, register dependencies, taken control transfers,
+/// the ctrlsig latency, forwarding of the D register, the depth of the
+/// signature stack and the jumps of the blocks created by split_edge. It is
+/// meant to compare hardware trade-offs on the plugin's actual output, not to
+/// replace RTL simulation.
+///
+/// Each trace line holds the PC and the instruction word as the first two
+/// 0x-prefixed hexadecimal numbers, which covers `spike --log-commits` and the
+/// qemu execlog plugin.
+///
+/// Build: g++ -O2 -o sim sim.cpp
+/// Usage: sim [options] trace
+///
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+struct sim_config {
+  // I-cache geometry and timing.
+  unsigned icache_size = 16384;
+  unsigned icache_line = 32;
+  unsigned icache_assoc = 2;
+  unsigned icache_miss_penalty = 20;
+
+  // Extra cycles of a taken branch or jump.
+  unsigned taken_penalty = 2;
+
+  // Result latencies.
+  unsigned load_latency = 2;
+  unsigned mul_latency = 3;
+  unsigned div_latency = 20;
+
+  // Cycles before a ctrlsig result can be used by the next ctrlsig.
+  unsigned ctrlsig_latency = 1;
+
+  // Without forwarding, D is only readable once it is written back.
+  bool d_forward = true;
+  unsigned wb_stages = 2;
+
+  // Entries of the on-chip signature stack and the cost of moving one entry
+  // between the stack and memory.
+  unsigned stack_depth = 8;
+  unsigned spill_penalty = 4;
+
+  // Encode ctrlsig in 16 bits.
+  bool compressed_ctrlsig = false;
+
+  // Issue a ctrlsig together with a directly following branch or jump.
+  bool fuse_check_branch = false;
+};
+
+struct sim_stats {
+  uint64_t insts = 0;
+  uint64_t cycles = 0;
+  uint64_t ctrlsigs = 0;
+  uint64_t ctrlsig_cycles = 0;
+  uint64_t d_stall_cycles = 0;
+  uint64_t fused = 0;
+  uint64_t pushes = 0;
+  uint64_t pops = 0;
+  uint64_t spills = 0;
+  uint64_t fills = 0;
+  uint64_t spill_cycles = 0;
+  uint64_t split_jumps = 0;
+  uint64_t split_jump_cycles = 0;
+  uint64_t taken = 0;
+  uint64_t taken_cycles = 0;
+  uint64_t data_stall_cycles = 0;
+  uint64_t icache_accesses = 0;
+  uint64_t icache_misses = 0;
+  uint64_t icache_miss_cycles = 0;
+};
+
+/**
+  * Set-associative I-cache with LRU replacement.
+  */
+class icache {
+public:
+  explicit icache(const sim_config &cfg)
+    : line(cfg.icache_line), assoc(cfg.icache_assoc),
+      sets(cfg.icache_size / (cfg.icache_line * cfg.icache_assoc)),
+      tags(sets * assoc, UINT64_MAX), stamps(sets * assoc, 0) {}
+
+  /**
+    * @return true if the line holding @param addr hits
+    */
+  bool access(uint64_t addr) {
+    uint64_t block = addr / line;
+    size_t set = block % sets;
+    size_t victim = set * assoc;
+
+    ++now;
+    for (size_t way = set * assoc; way < (set + 1) * assoc; ++way) {
+      if (tags[way] == block) {
+        stamps[way] = now;
+        return true;
+      }
+      if (stamps[way] < stamps[victim])
+        victim = way;
+    }
+    tags[victim] = block;
+    stamps[victim] = now;
+    return false;
+  }
+
+private:
+  uint64_t line;
+  size_t assoc;
+  size_t sets;
+  std::vector<uint64_t> tags;
+  std::vector<uint64_t> stamps;
+  uint64_t now = 0;
+};
+
+// Instruction classes the model distinguishes.
+enum inst_kind {
+  K_ALU,
+  K_LOAD,
+  K_MUL,
+  K_DIV,
+  K_BRANCH,
+  K_JUMP,
+  K_CTRLSIG_S,
+  K_CTRLSIG_M,
+  K_PUSHSIG,
+  K_POPSIG
+};
+
+struct inst_info {
+  inst_kind kind = K_ALU;
+  unsigned len = 4;
+  int rd = 0;
+  int rs1 = 0;
+  int rs2 = 0;
+  // ctrlsig immediate d, which is 0 in the blocks created by split_edge.
+  unsigned d = 0;
+};
+
+/**
+  * Decodes the fields the timing model depends on. Register 0 stands for
+  * "no register".
+  */
+static inst_info decode(uint32_t insn)
+{
+  inst_info info;
+
+  if ((insn & 3) != 3) {
+    // Compressed instructions: only control transfers matter here.
+    unsigned op = insn & 3, funct3 = (insn >> 13) & 7;
+    info.len = 2;
+    if (op == 1 && funct3 == 5)
+      info.kind = K_JUMP;
+    else if (op == 1 && funct3 >= 6)
+      info.kind = K_BRANCH;
+    else if (op == 2 && funct3 == 4 && ((insn >> 2) & 0x1f) == 0
+             && ((insn >> 7) & 0x1f) != 0)
+      info.kind = K_JUMP;
+    else if ((op == 0 && (funct3 == 2 || funct3 == 3))
+             || (op == 2 && (funct3 == 2 || funct3 == 3)))
+      info.kind = K_LOAD;
+    return info;
+  }
+
+  unsigned opcode = insn & 0x7f;
+  unsigned funct3 = (insn >> 12) & 7;
+  unsigned funct7 = insn >> 25;
+  int rd = (insn >> 7) & 0x1f, rs1 = (insn >> 15) & 0x1f,
+      rs2 = (insn >> 20) & 0x1f;
+
+  switch (opcode) {
+  case 0x03: // LOAD
+    info.kind = K_LOAD;
+    info.rd = rd;
+    info.rs1 = rs1;
+    break;
+  case 0x23: // STORE
+  case 0x2f: // AMO
+    info.rs1 = rs1;
+    info.rs2 = rs2;
+    info.rd = opcode == 0x2f ? rd : 0;
+    info.kind = opcode == 0x2f ? K_LOAD : K_ALU;
+    break;
+  case 0x33: // OP
+  case 0x3b: // OP-32
+    info.rd = rd;
+    info.rs1 = rs1;
+    info.rs2 = rs2;
+    if (funct7 == 1)
+      info.kind = funct3 < 4 ? K_MUL : K_DIV;
+    break;
+  case 0x13: // OP-IMM
+  case 0x1b: // OP-IMM-32
+    info.rd = rd;
+    info.rs1 = rs1;
+    break;
+  case 0x37: // LUI
+  case 0x17: // AUIPC
+    info.rd = rd;
+    break;
+  case 0x63: // BRANCH
+    info.kind = K_BRANCH;
+    info.rs1 = rs1;
+    info.rs2 = rs2;
+    break;
+  case 0x6f: // JAL
+    info.kind = K_JUMP;
+    info.rd = rd;
+    break;
+  case 0x67: // JALR
+    info.kind = K_JUMP;
+    info.rd = rd;
+    info.rs1 = rs1;
+    break;
+  case 0x0b: // CUSTOM_0: ctrlsig_s/m
+    info.kind = (insn >> 7) & 1 ? K_CTRLSIG_M : K_CTRLSIG_S;
+    info.d = insn >> 24;
+    break;
+  case 0x2b: // CUSTOM_1: pushsig/popsig
+    if (rd == 2)
+      info.kind = K_PUSHSIG;
+    else if (rd == 3)
+      info.kind = K_POPSIG;
+    break;
+  }
+  return info;
+}
+
+/**
+  * Extracts the PC and the instruction word from a trace line.
+  * @return false if the line does not hold both
+  */
+static bool parse_line(const std::string &line, uint64_t &pc, uint32_t &insn)
+{
+  uint64_t vals[2];
+  int found = 0;
+
+  for (size_t pos = line.find("0x"); pos != std::string::npos && found < 2;
+       pos = line.find("0x", pos + 2)) {
+    char *end;
+    vals[found] = strtoull(line.c_str() + pos + 2, &end, 16);
+    if (end != line.c_str() + pos + 2)
+      ++found;
+  }
+  if (found < 2)
+    return false;
+  pc = vals[0];
+  insn = static_cast<uint32_t>(vals[1]);
+  return true;
+}
+
+/**
+  * Addresses after shrinking each ctrlsig that appears in the trace to 16
+  * bits. Only the instructions that were executed are known, so the layout is
+  * an approximation that is exact for the executed part of the image.
+  */
+class compressed_layout {
+public:
+  void add(uint64_t pc) { ctrlsig_pcs.push_back(pc); }
+
+  void finish() {
+    std::sort(ctrlsig_pcs.begin(), ctrlsig_pcs.end());
+    ctrlsig_pcs.erase(std::unique(ctrlsig_pcs.begin(), ctrlsig_pcs.end()),
+                      ctrlsig_pcs.end());
+  }
+
+  uint64_t map(uint64_t pc) const {
+    return pc - 2 * (std::lower_bound(ctrlsig_pcs.begin(), ctrlsig_pcs.end(),
+                                      pc) - ctrlsig_pcs.begin());
+  }
+
+private:
+  std::vector<uint64_t> ctrlsig_pcs;
+};
+
+class pipeline {
+public:
+  pipeline(const sim_config &cfg, const compressed_layout *layout)
+    : cfg(cfg), layout(layout), cache(cfg) {}
+
+  void step(uint64_t pc, uint32_t insn);
+
+  const sim_stats &stats() const { return st; }
+
+private:
+  const sim_config &cfg;
+  const compressed_layout *layout;
+  icache cache;
+  sim_stats st;
+
+  // Cycle at which each register, G and D become readable.
+  uint64_t reg_ready[32] = {};
+  uint64_t g_ready = 0;
+  uint64_t d_ready = 0;
+
+  // The previous instruction.
+  bool have_prev = false;
+  uint64_t prev_pc = 0;
+  uint64_t prev_issue = 0;
+  inst_info prev;
+  bool prev_fused = false;
+  bool prev_split_ctrlsig = false;
+  bool prev_split_jump = false;
+  uint64_t prev_fetch_line = UINT64_MAX;
+
+  // Signature stack occupancy on chip and in memory.
+  unsigned stack_on_chip = 0;
+  uint64_t stack_in_memory = 0;
+};
+
+void pipeline::step(uint64_t pc, uint32_t insn)
+{
+  inst_info info = decode(insn);
+  bool is_ctrlsig = info.kind == K_CTRLSIG_S || info.kind == K_CTRLSIG_M;
+  bool is_split_jump = prev_split_ctrlsig && info.kind == K_JUMP
+                       && info.rd == 0 && info.rs1 == 0;
+  // Front-end bubbles in front of this instruction.
+  uint64_t extra = 0;
+
+  ++st.insts;
+
+  // Fetch.
+  uint64_t fetch_pc = layout ? layout->map(pc) : pc;
+  unsigned fetch_len = is_ctrlsig && cfg.compressed_ctrlsig ? 2 : info.len;
+  for (uint64_t line = fetch_pc / cfg.icache_line;
+       line <= (fetch_pc + fetch_len - 1) / cfg.icache_line; ++line) {
+    if (line == prev_fetch_line)
+      continue;
+    ++st.icache_accesses;
+    if (!cache.access(line * cfg.icache_line)) {
+      ++st.icache_misses;
+      st.icache_miss_cycles += cfg.icache_miss_penalty;
+      extra += cfg.icache_miss_penalty;
+    }
+    prev_fetch_line = line;
+  }
+
+  // The previous instruction was a taken branch or jump.
+  if (have_prev && pc != prev_pc + prev.len) {
+    ++st.taken;
+    st.taken_cycles += cfg.taken_penalty;
+    extra += cfg.taken_penalty;
+    if (prev_split_jump)
+      st.split_jump_cycles += cfg.taken_penalty;
+  }
+
+  // A ctrlsig directly followed by a branch or jump issues with it.
+  bool fused = cfg.fuse_check_branch && have_prev && !prev_fused
+               && (prev.kind == K_CTRLSIG_S || prev.kind == K_CTRLSIG_M)
+               && (info.kind == K_BRANCH || info.kind == K_JUMP);
+
+  uint64_t start = (have_prev ? prev_issue + (fused ? 0 : 1) : 0) + extra;
+  uint64_t ready = start;
+
+  if (info.rs1)
+    ready = std::max(ready, reg_ready[info.rs1]);
+  if (info.rs2)
+    ready = std::max(ready, reg_ready[info.rs2]);
+  st.data_stall_cycles += ready - start;
+
+  if (is_ctrlsig || info.kind == K_PUSHSIG) {
+    ready = std::max(ready, g_ready);
+    if (info.kind == K_CTRLSIG_M && d_ready > ready) {
+      st.d_stall_cycles += d_ready - ready;
+      ready = d_ready;
+    }
+  }
+
+  uint64_t issue = ready;
+
+  switch (info.kind) {
+  case K_CTRLSIG_S:
+  case K_CTRLSIG_M:
+    ++st.ctrlsigs;
+    g_ready = issue + cfg.ctrlsig_latency;
+    d_ready = issue + cfg.ctrlsig_latency
+              + (cfg.d_forward ? 0 : cfg.wb_stages);
+    break;
+  case K_PUSHSIG:
+    ++st.pushes;
+    if (stack_on_chip == cfg.stack_depth) {
+      ++st.spills;
+      ++stack_in_memory;
+      st.spill_cycles += cfg.spill_penalty;
+      issue += cfg.spill_penalty;
+    } else {
+      ++stack_on_chip;
+    }
+    break;
+  case K_POPSIG:
+    ++st.pops;
+    if (stack_on_chip > 0) {
+      --stack_on_chip;
+    } else if (stack_in_memory > 0) {
+      ++st.fills;
+      --stack_in_memory;
+      st.spill_cycles += cfg.spill_penalty;
+      issue += cfg.spill_penalty;
+    }
+    g_ready = d_ready = issue + 1;
+    break;
+  default:
+    break;
+  }
+
+  uint64_t latency = 1;
+  if (info.kind == K_LOAD)
+    latency = cfg.load_latency;
+  else if (info.kind == K_MUL)
+    latency = cfg.mul_latency;
+  else if (info.kind == K_DIV)
+    latency = cfg.div_latency;
+  if (info.rd)
+    reg_ready[info.rd] = issue + latency;
+
+  // Cycles this instruction adds to the total.
+  uint64_t charged = have_prev ? issue - prev_issue : issue + 1;
+  if (is_ctrlsig)
+    st.ctrlsig_cycles += charged;
+  if (fused)
+    ++st.fused;
+  if (is_split_jump) {
+    ++st.split_jumps;
+    st.split_jump_cycles += charged;
+  }
+
+  have_prev = true;
+  prev_pc = pc;
+  prev_issue = issue;
+  prev = info;
+  prev_fused = fused;
+  // The blocks created by split_edge hold a ctrlsig with d = 0 followed by an
+  // unconditional jump to the original successor.
+  prev_split_ctrlsig = is_ctrlsig && info.d == 0;
+  prev_split_jump = is_split_jump;
+  st.cycles = issue + 1;
+}
+
+static void report(const sim_stats &st)
+{
+  auto pct = [&st](uint64_t part) {
+    return st.cycles ? 100.0 * part / st.cycles : 0.0;
+  };
+
+  printf("instructions        %" PRIu64 "\n", st.insts);
+  printf("cycles              %" PRIu64 "\n", st.cycles);
+  printf("CPI                 %.3f\n",
+         st.insts ? static_cast<double>(st.cycles) / st.insts : 0.0);
+  printf("ctrlsig             %" PRIu64 " (%" PRIu64 " cycles, %.2f%%)\n",
+         st.ctrlsigs, st.ctrlsig_cycles, pct(st.ctrlsig_cycles));
+  printf("  D stalls          %" PRIu64 " cycles\n", st.d_stall_cycles);
+  printf("  fused             %" PRIu64 "\n", st.fused);
+  printf("pushsig/popsig      %" PRIu64 "/%" PRIu64 "\n", st.pushes, st.pops);
+  printf("  spills/fills      %" PRIu64 "/%" PRIu64 " (%" PRIu64
+         " cycles, %.2f%%)\n",
+         st.spills, st.fills, st.spill_cycles, pct(st.spill_cycles));
+  printf("split-edge jumps    %" PRIu64 " (%" PRIu64 " cycles, %.2f%%)\n",
+         st.split_jumps, st.split_jump_cycles, pct(st.split_jump_cycles));
+  printf("taken transfers     %" PRIu64 " (%" PRIu64 " cycles)\n",
+         st.taken, st.taken_cycles);
+  printf("data stalls         %" PRIu64 " cycles\n", st.data_stall_cycles);
+  printf("I-cache             %" PRIu64 " accesses, %" PRIu64
+         " misses (%" PRIu64 " cycles, %.2f%%)\n",
+         st.icache_accesses, st.icache_misses, st.icache_miss_cycles,
+         pct(st.icache_miss_cycles));
+}
+
+static void usage()
+{
+  fprintf(stderr,
+"Usage: sim [options] trace\n"
+"  --icache-size=N          I-cache size in bytes (16384)\n"
+"  --icache-line=N          line size in bytes (32)\n"
+"  --icache-assoc=N         associativity (2)\n"
+"  --icache-miss-penalty=N  miss penalty in cycles (20)\n"
+"  --taken-penalty=N        taken branch/jump penalty (2)\n"
+"  --load-latency=N         (2)\n"
+"  --mul-latency=N          (3)\n"
+"  --div-latency=N          (20)\n"
+"  --ctrlsig-latency=N      ctrlsig result latency (1)\n"
+"  --no-d-forward           D readable only after write-back\n"
+"  --wb-stages=N            stages between execute and write-back (2)\n"
+"  --stack-depth=N          on-chip signature stack entries (8)\n"
+"  --spill-penalty=N        cycles per spilled or filled entry (4)\n"
+"  --compressed-ctrlsig     16-bit ctrlsig encoding\n"
+"  --fuse-check-branch      issue ctrlsig with a following branch/jump\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  sim_config cfg;
+  const char *path = nullptr;
+  struct {
+    const char *name;
+    unsigned *val;
+  } uint_opts[] = {
+    { "--icache-size=", &cfg.icache_size },
+    { "--icache-line=", &cfg.icache_line },
+    { "--icache-assoc=", &cfg.icache_assoc },
+    { "--icache-miss-penalty=", &cfg.icache_miss_penalty },
+    { "--taken-penalty=", &cfg.taken_penalty },
+    { "--load-latency=", &cfg.load_latency },
+    { "--mul-latency=", &cfg.mul_latency },
+    { "--div-latency=", &cfg.div_latency },
+    { "--ctrlsig-latency=", &cfg.ctrlsig_latency },
+    { "--wb-stages=", &cfg.wb_stages },
+    { "--stack-depth=", &cfg.stack_depth },
+    { "--spill-penalty=", &cfg.spill_penalty },
+  };
+
+  for (int i = 1; i < argc; ++i) {
+    bool matched = false;
+    for (auto &opt : uint_opts) {
+      size_t len = strlen(opt.name);
+      if (strncmp(argv[i], opt.name, len) == 0) {
+        *opt.val = strtoul(argv[i] + len, nullptr, 0);
+        matched = true;
+      }
+    }
+    if (matched)
+      continue;
+    if (strcmp(argv[i], "--no-d-forward") == 0)
+      cfg.d_forward = false;
+    else if (strcmp(argv[i], "--compressed-ctrlsig") == 0)
+      cfg.compressed_ctrlsig = true;
+    else if (strcmp(argv[i], "--fuse-check-branch") == 0)
+      cfg.fuse_check_branch = true;
+    else if (argv[i][0] == '-' || path)
+      usage();
+    else
+      path = argv[i];
+  }
+  if (!path || cfg.icache_line == 0 || cfg.icache_assoc == 0
+      || cfg.icache_size < cfg.icache_line * cfg.icache_assoc)
+    usage();
+
+  std::string line;
+  uint64_t pc;
+  uint32_t insn;
+
+  // Compressing ctrlsig moves the code after it, so the executed ctrlsig
+  // instructions are collected in a first pass.
+  compressed_layout layout;
+  if (cfg.compressed_ctrlsig) {
+    std::ifstream trace(path);
+    if (!trace) {
+      fprintf(stderr, "sim: cannot open %s\n", path);
+      return 1;
+    }
+    while (std::getline(trace, line))
+      if (parse_line(line, pc, insn) && (insn & 0x7f) == 0x0b)
+        layout.add(pc);
+    layout.finish();
+  }
+
+  std::ifstream trace(path);
+  if (!trace) {
+    fprintf(stderr, "sim: cannot open %s\n", path);
+    return 1;
+  }
+  pipeline pipe(cfg, cfg.compressed_ctrlsig ? &layout : nullptr);
+  while (std::getline(trace, line))
+    if (parse_line(line, pc, insn))
+      pipe.step(pc, insn);
+
+  report(pipe.stats());
+  return 0;
+}
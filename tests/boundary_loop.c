@@ -0,0 +1,23 @@
+/* A loop right after the call of a function with boundary signatures: G
+   holds the return signature of step() when walk() enters the loop, so the
+   check of the loop header must stay in the header. sum() has the same loop
+   without the call, and its check moves into the padding. */
+__attribute__((noinline)) void step(int *a)
+{
+  a[0] += a[1];
+}
+
+int walk(int *a, int n)
+{
+  step(a);
+  while (a[0] < n)
+    a[0] += a[1];
+  return a[0];
+}
+
+int sum(int *a, int n)
+{
+  while (a[0] < n)
+    a[0] += a[1];
+  return a[0];
+}
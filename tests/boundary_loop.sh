@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+# Checks that the check of a loop header does not move into the padding when
+# the only block entering the loop calls a function with boundary signatures:
+# of the two loops of tests/boundary_loop.c, only the one in sum() may take
+# the alignment padding.
+#
+# Usage: tests/boundary_loop.sh
+#
+# Environment:
+#   CC, CFLAGS      cross compiler and flags (riscv64-unknown-elf-gcc, -O2)
+#   PLUGIN          the plugin (plugin.so or plugin.dylib)
+set -euo pipefail
+
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+CC=${CC:-riscv64-unknown-elf-gcc}
+CFLAGS=${CFLAGS:--O2}
+if [ -z "${PLUGIN:-}" ]; then
+  PLUGIN=$DIR/plugin.so
+  [ -f "$PLUGIN" ] || PLUGIN=$DIR/plugin.dylib
+fi
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+echo "step boundary-signatures=1" > "$OUT/options"
+"$CC" $CFLAGS -fplugin="$PLUGIN" -fplugin-arg-plugin-align-padding=1 \
+  -fplugin-arg-plugin-options-file="$OUT/options" \
+  -fopt-info-optimized="$OUT/remarks" \
+  -S "$DIR/tests/boundary_loop.c" -o "$OUT/boundary_loop.s"
+moved=$(grep -c 'moved check of loop header' "$OUT/remarks" || true)
+echo "loop headers with their check in the padding: $moved"
+if [ "$moved" -ne 1 ]; then
+  echo "expected only the loop of sum() to move its check: FAIL"
+  exit 1
+fi
+echo "loop after a boundary call keeps its check: ok"
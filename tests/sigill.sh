@@ -0,0 +1,49 @@
+#!/usr/bin/env bash
+# Checks that a stray illegal instruction still kills a program linked with
+# the runtime by SIGILL, both with and without the sigaction()/signal()
+# wrappers, instead of trapping into the runtime forever.
+#
+# Usage: tests/sigill.sh
+#
+# Environment:
+#   CC, CXX         RISC-V Linux cross compilers (riscv64-linux-gnu-gcc/g++)
+#   RUN             how to run a RISC-V binary
+#                   (qemu-riscv64 -L /usr/riscv64-linux-gnu)
+#   TIMEOUT         seconds after which a run counts as hung (10)
+set -euo pipefail
+
+CC=${CC:-riscv64-linux-gnu-gcc}
+CXX=${CXX:-riscv64-linux-gnu-g++}
+RUN=${RUN:-qemu-riscv64 -L /usr/riscv64-linux-gnu}
+TIMEOUT=${TIMEOUT:-10}
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+"$CXX" -O2 -fno-exceptions -fno-rtti -c "$DIR/runtime.cpp" -o "$OUT/runtime.o"
+"$CC" -O2 -c "$DIR/tests/stray_sigill.c" -o "$OUT/stray_sigill.o"
+
+status=0
+
+# run NAME [LDFLAGS...]: links and runs the test, which must die by SIGILL.
+run() {
+  local name=$1 rc=0
+  shift
+  "$CXX" "$@" -o "$OUT/$name" "$OUT/stray_sigill.o" "$OUT/runtime.o"
+  timeout "$TIMEOUT" $RUN "$OUT/$name" 2> /dev/null || rc=$?
+  if [ "$rc" -eq 124 ]; then
+    echo "$name: hung in the SIGILL handler: FAIL"
+    status=1
+  elif [ "$rc" -ne $((128 + $(kill -l ILL))) ]; then
+    echo "$name: exit status $rc instead of SIGILL: FAIL"
+    status=1
+  else
+    echo "$name: killed by SIGILL: ok"
+  fi
+}
+
+run plain
+run wrapped -Wl,--wrap=sigaction,--wrap=signal
+
+exit $status
@@ -0,0 +1,7 @@
+/* An illegal instruction that is none of ours: the runtime must let it
+   terminate the process with SIGILL, as it would without the runtime. */
+int main(void)
+{
+  __asm__ volatile ("unimp");
+  return 0;
+}
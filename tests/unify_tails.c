@@ -0,0 +1,16 @@
+/* Two identical error tails: with unify-tails they get the same check, so
+   cross-jumping can still fold them into one call of fail(). */
+extern void fail(int code);
+
+int add_checked(int a, int b)
+{
+  if (a < 0) {
+    fail(1);
+    return -1;
+  }
+  if (b < 0) {
+    fail(1);
+    return -1;
+  }
+  return a + b;
+}
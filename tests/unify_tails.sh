@@ -0,0 +1,40 @@
+#!/usr/bin/env bash
+# Checks that identical tails still merge after instrumentation with
+# unify-tails: the two error paths of tests/unify_tails.c must end up as a
+# single call of fail() in the assembly, while without the option their
+# different checks keep them apart.
+#
+# Usage: tests/unify_tails.sh
+#
+# Environment:
+#   CC, CFLAGS      cross compiler and flags (riscv64-unknown-elf-gcc, -O2)
+#   PLUGIN          the plugin (plugin.so or plugin.dylib)
+set -euo pipefail
+
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+CC=${CC:-riscv64-unknown-elf-gcc}
+CFLAGS=${CFLAGS:--O2}
+if [ -z "${PLUGIN:-}" ]; then
+  PLUGIN=$DIR/plugin.so
+  [ -f "$PLUGIN" ] || PLUGIN=$DIR/plugin.dylib
+fi
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+# calls UNIFY: the number of calls of fail() with unify-tails=UNIFY.
+calls() {
+  "$CC" $CFLAGS -fplugin="$PLUGIN" -fplugin-arg-plugin-unify-tails="$1" \
+    -S "$DIR/tests/unify_tails.c" -o "$OUT/unify$1.s"
+  grep -cE '^[[:space:]]*(call|tail|jal)[[:space:]]+(ra,[[:space:]]*)?fail' \
+    "$OUT/unify$1.s" || true
+}
+
+merged=$(calls 1)
+apart=$(calls 0)
+echo "calls of fail(): $apart without unify-tails, $merged with it"
+if [ "$merged" -ne 1 ]; then
+  echo "identical tails were not merged: FAIL"
+  exit 1
+fi
+echo "identical tails merged: ok"
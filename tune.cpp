@@ -0,0 +1,380 @@
+///
+/// Parallel auto-tuner for the instrumentation options.
+///
+/// The tuner compiles a benchmark with every combination of the given option
+/// values, spread over all cores, measures each build and reads the plugin's
+/// statistics to rate its protection. It prints the Pareto front of overhead
+/// against protection and writes the options file of the configuration that
+/// best meets the constraint. With --per-function, each function is then
+/// tuned on its own starting from that configuration.
+///
+/// The compile command is a shell command in which {args} is replaced by the
+/// plugin arguments and {out} by the output file. The measure command prints
+/// the overhead of {out} as the last number of its output, e.g. the cycles
+/// reported by sim; the default is the text size.
+///
+/// Build: g++ -O2 -pthread -o tune tune.cpp
+/// Usage: tune --compile CMD [options] --knob key=v1,v2,... ...
+///
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+typedef std::vector<std::pair<std::string, std::string>> assignment;
+
+struct tune_config {
+  std::string compile;
+  std::string measure = "size {out} | awk 'NR == 2 { print $1 }'";
+  std::string plugin_name = "plugin";
+  std::string workdir = "tune.d";
+  std::string out = "cfcss.opts";
+  unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::pair<std::string, std::vector<std::string>>> knobs;
+  double min_protection = 0;
+  double max_overhead = -1;
+  bool per_function = false;
+};
+
+// A point of the search space: module-wide options plus overrides for some
+// functions.
+struct candidate {
+  assignment global;
+  std::map<std::string, assignment> functions;
+};
+
+struct result {
+  bool ok = false;
+  double overhead = 0;
+  double protection = 0;
+  // Functions that appear in the statistics.
+  std::vector<std::string> functions;
+};
+
+static tune_config cfg;
+
+static std::string replace_all(std::string str, const std::string &from,
+                               const std::string &to)
+{
+  for (size_t pos = str.find(from); pos != std::string::npos;
+       pos = str.find(from, pos + to.size()))
+    str.replace(pos, from.size(), to);
+  return str;
+}
+
+static std::string join(const assignment &opts)
+{
+  std::string str;
+  for (auto &opt : opts)
+    str += (str.empty() ? "" : " ") + opt.first + "=" + opt.second;
+  return str;
+}
+
+static std::string format(const assignment &opts)
+{
+  return opts.empty() ? "(defaults)" : join(opts);
+}
+
+/**
+  * Sums the counters of a statistics file and rates the protection as the
+  * fraction of CFG and return edges that cannot be corrupted undetected.
+  */
+static bool read_stats(const std::string &path, result &res)
+{
+  std::ifstream file(path);
+  std::string line;
+  std::map<std::string, double> total;
+
+  if (!file)
+    return false;
+  while (std::getline(file, line)) {
+    std::istringstream tokens(line);
+    std::string kind, name, key;
+    double val;
+    if (!(tokens >> kind >> name) || kind != "function")
+      continue;
+    res.functions.push_back(name);
+    while (tokens >> key >> val)
+      total[key] += val;
+  }
+  std::sort(res.functions.begin(), res.functions.end());
+  res.functions.erase(std::unique(res.functions.begin(), res.functions.end()),
+                      res.functions.end());
+  double edges = total["edges"] + total["return_edges"];
+  res.protection = edges > 0 ? (total["protected_edges"]
+                                + total["protected_return_edges"]) / edges
+                             : 1.0;
+  return true;
+}
+
+/**
+  * Compiles and measures candidate @param cand as job @param id.
+  */
+static result evaluate(const candidate &cand, size_t id)
+{
+  std::string base = cfg.workdir + "/" + std::to_string(id);
+  std::string prefix = "-fplugin-arg-" + cfg.plugin_name + "-";
+  std::string args = prefix + "stats=" + base + ".stats";
+  result res;
+
+  for (auto &opt : cand.global)
+    args += " " + prefix + opt.first + "=" + opt.second;
+  if (!cand.functions.empty()) {
+    std::ofstream opts_file(base + ".opts");
+    for (auto &fn : cand.functions)
+      opts_file << fn.first << " " << join(fn.second) << "\n";
+    args += " " + prefix + "options-file=" + base + ".opts";
+  }
+  remove((base + ".stats").c_str());
+
+  std::string compile = replace_all(replace_all(cfg.compile, "{args}", args),
+                                    "{out}", base + ".out");
+  if (system((compile + " > " + base + ".log 2>&1").c_str()) != 0)
+    return res;
+
+  std::string measure = replace_all(cfg.measure, "{out}", base + ".out");
+  FILE *pipe = popen(measure.c_str(), "r");
+  if (!pipe)
+    return res;
+  std::string output;
+  char buffer[256];
+  while (fgets(buffer, sizeof(buffer), pipe))
+    output += buffer;
+  if (pclose(pipe) != 0)
+    return res;
+
+  // The last number of the output.
+  size_t end = output.find_last_of("0123456789");
+  if (end == std::string::npos)
+    return res;
+  size_t begin = output.find_last_not_of("0123456789.", end);
+  begin = begin == std::string::npos ? 0 : begin + 1;
+  res.overhead = atof(output.substr(begin, end - begin + 1).c_str());
+  res.ok = read_stats(base + ".stats", res);
+  return res;
+}
+
+/**
+  * Evaluates @param cands on cfg.jobs threads. Job numbers start at
+  * @param first_id so that the files of earlier rounds survive.
+  */
+static std::vector<result> evaluate_all(const std::vector<candidate> &cands,
+                                        size_t first_id)
+{
+  std::vector<result> results(cands.size());
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+
+  for (unsigned i = 0; i < std::min<size_t>(cfg.jobs, cands.size()); ++i)
+    workers.emplace_back([&]() {
+      for (size_t j = next++; j < cands.size(); j = next++) {
+        results[j] = evaluate(cands[j], first_id + j);
+        fprintf(stderr, "tune: [%zu/%zu] %s\n", j + 1, cands.size(),
+                results[j].ok ? "done" : "failed");
+      }
+    });
+  for (auto &worker : workers)
+    worker.join();
+  return results;
+}
+
+/**
+  * @return all combinations of the knob values
+  */
+static std::vector<assignment> combinations()
+{
+  std::vector<assignment> combos(1);
+
+  for (auto &knob : cfg.knobs) {
+    std::vector<assignment> next;
+    for (auto &combo : combos)
+      for (auto &val : knob.second) {
+        next.push_back(combo);
+        next.back().emplace_back(knob.first, val);
+      }
+    combos.swap(next);
+  }
+  return combos;
+}
+
+static bool meets_constraint(const result &res)
+{
+  return res.ok && res.protection >= cfg.min_protection
+         && (cfg.max_overhead < 0 || res.overhead <= cfg.max_overhead);
+}
+
+/**
+  * @return whether @param a is preferred to @param b: lower overhead under a
+  * protection constraint, higher protection under an overhead constraint
+  */
+static bool better(const result &a, const result &b)
+{
+  if (cfg.max_overhead >= 0)
+    return a.protection > b.protection
+           || (a.protection == b.protection && a.overhead < b.overhead);
+  return a.overhead < b.overhead
+         || (a.overhead == b.overhead && a.protection > b.protection);
+}
+
+/**
+  * @return the indices of the results on the Pareto front, by overhead
+  */
+static std::vector<size_t> pareto_front(const std::vector<result> &results)
+{
+  std::vector<size_t> order, front;
+
+  for (size_t i = 0; i < results.size(); ++i)
+    if (results[i].ok)
+      order.push_back(i);
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return results[a].overhead < results[b].overhead
+           || (results[a].overhead == results[b].overhead
+               && results[a].protection > results[b].protection);
+  });
+  for (size_t i : order)
+    if (front.empty()
+        || results[i].protection > results[front.back()].protection)
+      front.push_back(i);
+  return front;
+}
+
+static void usage()
+{
+  fprintf(stderr,
+"Usage: tune --compile CMD [options] --knob key=v1,v2,... ...\n"
+"  --compile CMD         build command; {args} and {out} are replaced\n"
+"  --measure CMD         prints the overhead of {out} last (text size)\n"
+"  --knob KEY=V1,V2,...  plugin option and the values to try\n"
+"  --min-protection P    minimum protection of the selected options (0)\n"
+"  --max-overhead X      maximum overhead of the selected options\n"
+"  --per-function        tune each function starting from the selection\n"
+"  --jobs N              parallel builds (number of cores)\n"
+"  --plugin-name NAME    base name of the plugin (plugin)\n"
+"  --workdir DIR         directory of the builds (tune.d)\n"
+"  --out FILE            selected per-function options (cfcss.opts)\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--per-function") {
+      cfg.per_function = true;
+      continue;
+    }
+    if (i + 1 == argc)
+      usage();
+    std::string val = argv[++i];
+    if (arg == "--compile") {
+      cfg.compile = val;
+    } else if (arg == "--measure") {
+      cfg.measure = val;
+    } else if (arg == "--min-protection") {
+      cfg.min_protection = atof(val.c_str());
+    } else if (arg == "--max-overhead") {
+      cfg.max_overhead = atof(val.c_str());
+    } else if (arg == "--jobs") {
+      cfg.jobs = std::max(1, atoi(val.c_str()));
+    } else if (arg == "--plugin-name") {
+      cfg.plugin_name = val;
+    } else if (arg == "--workdir") {
+      cfg.workdir = val;
+    } else if (arg == "--out") {
+      cfg.out = val;
+    } else if (arg == "--knob") {
+      size_t eq = val.find('=');
+      if (eq == std::string::npos)
+        usage();
+      std::vector<std::string> vals;
+      std::istringstream list(val.substr(eq + 1));
+      for (std::string v; std::getline(list, v, ',');)
+        vals.push_back(v);
+      cfg.knobs.emplace_back(val.substr(0, eq), vals);
+    } else {
+      usage();
+    }
+  }
+  if (cfg.compile.empty())
+    usage();
+  mkdir(cfg.workdir.c_str(), 0777);
+
+  // Search the module-wide options.
+  std::vector<candidate> cands;
+  for (auto &combo : combinations())
+    cands.push_back({ combo, {} });
+  std::vector<result> results = evaluate_all(cands, 0);
+
+  printf("Pareto front (overhead, protection, options):\n");
+  for (size_t i : pareto_front(results))
+    printf("  %-14g %-10.4f %s\n", results[i].overhead,
+           results[i].protection, format(cands[i].global).c_str());
+
+  size_t best = cands.size();
+  for (size_t i = 0; i < cands.size(); ++i)
+    if (meets_constraint(results[i])
+        && (best == cands.size() || better(results[i], results[best])))
+      best = i;
+  if (best == cands.size()) {
+    fprintf(stderr, "tune: no configuration meets the constraint\n");
+    return 1;
+  }
+  printf("Selected: %s\n", format(cands[best].global).c_str());
+
+  candidate selected;
+  for (auto &fn : results[best].functions)
+    selected.functions[fn] = cands[best].global;
+
+  // Try the alternatives of each function with everything else fixed, keep
+  // the best alternative of each function, and check that the combination
+  // still meets the constraint.
+  if (cfg.per_function) {
+    std::vector<candidate> fn_cands;
+    std::vector<std::string> fn_names;
+    for (auto &fn : results[best].functions)
+      for (auto &combo : combinations()) {
+        if (combo == cands[best].global)
+          continue;
+        fn_cands.push_back(selected);
+        fn_cands.back().functions[fn] = combo;
+        fn_names.push_back(fn);
+      }
+    std::vector<result> fn_results = evaluate_all(fn_cands, cands.size());
+
+    candidate combined = selected;
+    std::map<std::string, result> fn_best;
+    for (size_t i = 0; i < fn_cands.size(); ++i) {
+      auto it = fn_best.find(fn_names[i]);
+      if (meets_constraint(fn_results[i])
+          && better(fn_results[i], it == fn_best.end() ? results[best]
+                                                       : it->second)) {
+        fn_best[fn_names[i]] = fn_results[i];
+        combined.functions[fn_names[i]] = fn_cands[i].functions[fn_names[i]];
+      }
+    }
+
+    result check = evaluate(combined, cands.size() + fn_cands.size());
+    if (meets_constraint(check) && !better(results[best], check)) {
+      printf("Per-function: overhead %g, protection %.4f\n", check.overhead,
+             check.protection);
+      selected = combined;
+    } else {
+      printf("Per-function: no improvement over the selection\n");
+    }
+  }
+
+  std::ofstream out(cfg.out);
+  for (auto &fn : selected.functions)
+    out << fn.first << " " << join(fn.second) << "\n";
+  printf("Options written to %s\n", cfg.out.c_str());
+  return 0;
+}